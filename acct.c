@@ -0,0 +1,251 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifdef __linux
+#define _GNU_SOURCE /* WTMPX_FILE */
+#endif
+#include "config.h"
+#include "acct.h"
+#include "util.h"
+#include "log.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if HAVE_UTMPX_H
+#include <utmpx.h>
+#endif
+#if HAVE_LASTLOG_H
+#include <lastlog.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef SOCK_SEQPACKET
+#define SOCK_SEQPACKET SOCK_DGRAM
+#endif
+
+/* What the session sends the writer: enough to fill in any of the files. */
+struct acct_rec {
+  int login;
+  long pid, uid;
+  long sec, usec;
+  char user[32], line[32], host[64];
+};
+
+static struct acct_rec current;
+static int logged_in = 0, acct_fd = -1;
+
+static void acct_write(const struct acct_rec* r, int n);
+
+/* Unlike a log line, a record mustn't be lost, or who(1) keeps a session
+ * that has gone: if the writer is a whole socket buffer behind, we wait. */
+static void acct_send(int login)
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  current.login = login;
+  current.sec = tv.tv_sec;
+  current.usec = tv.tv_usec;
+  if (acct_fd < 0) {
+    acct_write(&current, 1);
+    return;
+  }
+  while (send(acct_fd, &current, sizeof(current), MSG_NOSIGNAL) < 0) {
+    if (errno == EINTR) continue;
+    log_perror("acct: send()");
+    break;
+  }
+}
+
+void acct_login(const char* user, uid_t uid, const char* host)
+{
+  memset(&current, 0, sizeof(current));
+  current.pid = (long)getpid();
+  current.uid = (long)uid;
+  /* We have no tty of our own to name the line after. */
+  snprintf(current.line, sizeof(current.line), "nl/%ld", current.pid);
+  strlcpy(current.user, user, sizeof(current.user));
+  strlcpy(current.host, host ? host : "", sizeof(current.host));
+  acct_send(1);
+  logged_in = 1;
+}
+
+void acct_logout()
+{
+  if (!logged_in) return;
+  logged_in = 0;
+  acct_send(0);
+}
+
+#if HAVE_UTMPX_H
+#define ACCT_CHUNK 64
+
+static void to_utmpx(const struct acct_rec* r, struct utmpx* ut)
+{
+  memset(ut, 0, sizeof(*ut));
+  ut->ut_type = r->login ? USER_PROCESS : DEAD_PROCESS;
+  ut->ut_pid = (pid_t)r->pid;
+  ut->ut_tv.tv_sec = r->sec;
+  ut->ut_tv.tv_usec = r->usec;
+  /* The id just has to pair a login with its logout. */
+  memcpy(ut->ut_id, &ut->ut_pid,
+         sizeof(ut->ut_id) < sizeof(ut->ut_pid) ? sizeof(ut->ut_id)
+                                                : sizeof(ut->ut_pid));
+  strncpy(ut->ut_line, r->line, sizeof(ut->ut_line));
+  if (r->login) {
+    strncpy(ut->ut_user, r->user, sizeof(ut->ut_user));
+    strncpy(ut->ut_host, r->host, sizeof(ut->ut_host));
+  }
+}
+
+/* One pass over utmpx, and one append to wtmp, for up to ACCT_CHUNK
+ * records. There's nowhere to report failure from the writer, and a missing
+ * file just means the system doesn't keep that record. */
+static void write_chunk(const struct acct_rec* r, int n)
+{
+  struct utmpx ut[ACCT_CHUNK];
+  int i;
+  setutxent();
+  for (i = 0; i < n; ++i) {
+    to_utmpx(&r[i], &ut[i]);
+    (void)pututxline(&ut[i]);
+  }
+  endutxent();
+#if defined(__linux) && defined(WTMPX_FILE)
+  /* glibc's wtmp is an array of the same records. */
+  {
+    int fd = open(WTMPX_FILE, O_WRONLY|O_APPEND|O_CLOEXEC);
+    if (fd >= 0) {
+      ssize_t rv = write(fd, ut, n * sizeof(ut[0]));
+      (void)rv;
+      (void)close(fd);
+    }
+  }
+#elif HAVE_UPDWTMPX && defined(WTMPX_FILE)
+  for (i = 0; i < n; ++i) updwtmpx(WTMPX_FILE, &ut[i]);
+#endif
+}
+#endif
+
+#if HAVE_LASTLOG_H && defined(_PATH_LASTLOG)
+/* A fixed-width field, which needn't be NUL-terminated (ll is zeroed). */
+static void set_field(char* field, size_t size, const char* str)
+{
+  memcpy(field, str, strnlen(str, size));
+}
+
+/* lastlog is indexed by uid; only logins touch it. */
+static void write_lastlog(const struct acct_rec* r, int n)
+{
+  struct lastlog ll;
+  int i, fd = open(_PATH_LASTLOG, O_RDWR|O_CLOEXEC);
+  if (fd < 0) return;
+  for (i = 0; i < n; ++i) {
+    if (!r[i].login) continue;
+    memset(&ll, 0, sizeof(ll));
+    ll.ll_time = r[i].sec;
+    set_field(ll.ll_line, sizeof(ll.ll_line), r[i].line);
+    set_field(ll.ll_host, sizeof(ll.ll_host), r[i].host);
+    if (pwrite(fd, &ll, sizeof(ll), (off_t)r[i].uid * sizeof(ll)) < 0) break;
+  }
+  (void)close(fd);
+}
+#endif
+
+static void acct_write(const struct acct_rec* r, int n)
+{
+#if HAVE_UTMPX_H
+  int i;
+  for (i = 0; i < n; i += ACCT_CHUNK)
+    write_chunk(r + i, n - i < ACCT_CHUNK ? n - i : ACCT_CHUNK);
+#endif
+#if HAVE_LASTLOG_H && defined(_PATH_LASTLOG)
+  write_lastlog(r, n);
+#endif
+  (void)r;
+}
+
+/* The writer: take whatever records are queued, and apply them together.
+ * Exits once every sender has gone. */
+#define ACCT_BATCH 256
+static void acct_writer(int fd)
+{
+  static struct acct_rec recs[ACCT_BATCH];
+  int eof = 0;
+  setproctitle("[acct]");
+  while (!eof) {
+    int n = 0, flags = 0;
+    while (n < ACCT_BATCH) {
+      ssize_t len = recv(fd, &recs[n], sizeof(recs[0]), flags);
+      if (len < 0 && errno == EINTR) continue;
+      if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if (len <= 0) { eof = 1; break; }
+      flags = MSG_DONTWAIT;
+      if (len == sizeof(recs[0])) ++n;
+    }
+    if (n) acct_write(recs, n);
+  }
+  _exit(0);
+}
+
+void acct_open()
+{
+  int fd[2];
+  if (acct_fd >= 0) return;
+  if (socketpair(PF_UNIX, SOCK_SEQPACKET, 0, fd) < 0) {
+    log_perror("acct_open:socketpair()");
+    return;
+  }
+  fflush(0);
+  pid_t rv = fork();
+  if (rv < 0) {
+    log_perror("acct_open:fork()");
+    (void)close(fd[0]);
+    (void)close(fd[1]);
+    return;
+  }
+  if (rv == 0) {
+    (void)close(fd[1]);
+    acct_writer(fd[0]);
+  }
+  (void)close(fd[0]);
+  (void)fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+  acct_fd = fd[1];
+}
+
+int acct_handoff()
+{
+  if (acct_fd >= 0) (void)fcntl(acct_fd, F_SETFD, 0);
+  return acct_fd;
+}
+
+void acct_adopt(int fd)
+{
+  if (fd >= 0) (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+  acct_fd = fd;
+}
@@ -0,0 +1,46 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef ACCT_H__
+#define ACCT_H__
+
+#include <sys/types.h>
+
+/*
+ * Login accounting, so who(1) and last(1) see our sessions: a utmpx entry
+ * while the session lasts, wtmp records of its login and logout, and the
+ * user's lastlog entry. The session only queues the records; an [acct]
+ * writer of its own applies them a batch at a time, so a login storm costs
+ * one pass over utmpx and one append to wtmp per batch, and no login waits
+ * on the files' locks or disks, nor holds up the [log] writer. Records are
+ * never dropped: a session waits for the writer rather than lose one.
+ */
+
+/* In the daemon, once detached: start the writer, unless one was adopted. */
+void acct_open();
+/* Across a restart's exec, as log_handoff() and log_adopt() (see log.h). */
+int acct_handoff();
+void acct_adopt(int fd);
+/* In the session: record its login, from host ("" if local)... */
+void acct_login(const char* user, uid_t uid, const char* host);
+/* ... and its logout, if acct_login() was called. */
+void acct_logout();
+
+#endif
@@ -0,0 +1,193 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#include <config.h>
+#include "cgroup.h"
+#include "util.h"
+#include "log.h"
+
+#ifdef __linux
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if HAVE_LINUX_SCHED_H
+#include <linux/sched.h>
+#endif
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+const char* cgroup_parent = 0;
+int cgroup_cpu_weight = 0;
+long long cgroup_memory_max = 0;
+
+#ifdef __linux
+
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+#define CAN_CLONE_INTO_CGROUP 1
+#else
+#define CAN_CLONE_INTO_CGROUP 0
+#endif
+
+static char leaf[1024];
+static int leaf_fd = -1;
+
+static int cgroup_write(int dir, const char* file, const char* value)
+{
+  int fd = openat(dir, file, O_WRONLY|O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t n = write(fd, value, strlen(value));
+  int saved_errno = errno;
+  (void)close(fd);
+  errno = saved_errno;
+  return n < 0 ? -1 : 0;
+}
+
+/* The number after key in one of a cgroup's flat-keyed files, or the first
+ * number in the file if key is null; -1 if it's not there. */
+static long long cgroup_read(int dir, const char* file, const char* key)
+{
+  char buf[1024], *p = buf;
+  int fd = openat(dir, file, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t n = read(fd, buf, sizeof(buf)-1);
+  (void)close(fd);
+  if (n <= 0) return -1;
+  buf[n] = '\0';
+  while (key && p) {
+    size_t len = strlen(key);
+    if (!strncmp(p, key, len) && p[len] == ' ') { p += len; break; }
+    if ((p = strchr(p, '\n'))) ++p;
+  }
+  return p ? strtoll(p, 0, 10) : -1;
+}
+
+void cgroup_setup()
+{
+  if (!cgroup_parent) return;
+  int dir = open(cgroup_parent, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dir < 0) perror_fatal(cgroup_parent);
+  /* This fails if the parent has processes of its own, or the controller
+   * isn't enabled above it; the limits then fail in each session. */
+  if (cgroup_cpu_weight &&
+      cgroup_write(dir, "cgroup.subtree_control", "+cpu") < 0)
+    log_perror("Enabling the cpu controller");
+  if (cgroup_memory_max &&
+      cgroup_write(dir, "cgroup.subtree_control", "+memory") < 0)
+    log_perror("Enabling the memory controller");
+  (void)close(dir);
+}
+
+int cgroup_create()
+{
+  char value[32];
+  const char* what = leaf;
+  if (!cgroup_parent) return 0;
+  snprintf(leaf, sizeof(leaf), "%s/session-%ld", cgroup_parent,
+           (long)getpid());
+  if (mkdir(leaf, 0755) < 0) {
+    log_perror(leaf);
+    leaf[0] = '\0';
+    return -1;
+  }
+  if ((leaf_fd = open(leaf, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+    goto fail;
+  if (cgroup_cpu_weight) {
+    what = "cpu.weight";
+    snprintf(value, sizeof(value), "%d", cgroup_cpu_weight);
+    if (cgroup_write(leaf_fd, what, value) < 0) goto fail;
+  }
+  if (cgroup_memory_max) {
+    what = "memory.max";
+    snprintf(value, sizeof(value), "%lld", cgroup_memory_max);
+    if (cgroup_write(leaf_fd, what, value) < 0) goto fail;
+  }
+  debug("Running commands in %s", leaf);
+  return 0;
+
+ fail:
+  log_perror(what);
+  if (leaf_fd >= 0) (void)close(leaf_fd);
+  leaf_fd = -1;
+  (void)rmdir(leaf);
+  leaf[0] = '\0';
+  return -1;
+}
+
+pid_t cgroup_fork()
+{
+#if CAN_CLONE_INTO_CGROUP
+  /* Starting the child in place saves it moving itself, which takes a
+   * write lock on the whole hierarchy. */
+  static int no_clone3 = 0;
+  if (leaf_fd >= 0 && !no_clone3) {
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = leaf_fd;
+    long rv = syscall(SYS_clone3, &args, sizeof(args));
+    if (rv >= 0) return (pid_t)rv;
+    if (errno == EAGAIN || errno == ENOMEM) return -1;
+    debug("clone3(CLONE_INTO_CGROUP) failed (%s); using fork()",
+          strerror(errno));
+    no_clone3 = 1;
+  }
+#endif
+  pid_t pid = fork();
+  if (pid == 0 && leaf_fd >= 0 &&
+      cgroup_write(leaf_fd, "cgroup.procs", "0") < 0) {
+    log_perror("Joining the session's cgroup");
+    _exit(1);
+  }
+  return pid;
+}
+
+void cgroup_finish(const char* username)
+{
+  char memory[48] = "";
+  if (leaf_fd < 0) return;
+  long long cpu = cgroup_read(leaf_fd, "cpu.stat", "usage_usec");
+  long long peak = cgroup_read(leaf_fd, "memory.peak", 0);
+  if (peak >= 0)
+    snprintf(memory, sizeof(memory), " memory_peak=%lld", peak);
+  logkv(LOG_INFO, "event=usage user=%s cpu_usec=%lld%s",
+        username ? username : "", cpu, memory);
+  (void)close(leaf_fd);
+  leaf_fd = -1;
+  /* Anything the user left running keeps it. */
+  if (rmdir(leaf) < 0) log_perror(leaf);
+}
+
+#else
+
+void cgroup_setup()
+{
+  if (cgroup_parent) fatal("cgroups are only supported on Linux");
+}
+
+int cgroup_create() { return 0; }
+pid_t cgroup_fork() { return fork(); }
+void cgroup_finish(const char* username) { }
+
+#endif
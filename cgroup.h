@@ -0,0 +1,46 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#ifndef CGROUP_H__
+#define CGROUP_H__
+
+#include <sys/types.h>
+
+/*
+ * Linux cgroup v2 placement. With -cgroup DIR, each session makes itself a
+ * leaf cgroup under DIR (which must be in the unified hierarchy, and have no
+ * processes of its own), sets its cpu.weight and memory.max, and starts the
+ * process serving its commands directly inside it, so they start there too.
+ * When the session ends, its usage is logged and the leaf removed.
+ * Elsewhere, and without -cgroup, these do nothing.
+ */
+extern const char* cgroup_parent;
+extern int cgroup_cpu_weight;        /* 1-10000, or 0 to leave the default */
+extern long long cgroup_memory_max;  /* bytes, or 0 for no limit */
+
+/* In the daemon: delegate the cpu and memory controllers to our leaves. */
+void cgroup_setup();
+/* In the session, as root: make its leaf. */
+int cgroup_create();
+/* Like fork(), but the child starts in the session's leaf. */
+pid_t cgroup_fork();
+/* Log the session's usage, and remove its leaf if it's empty. */
+void cgroup_finish(const char* username);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#include <config.h>
+#include "compress.h"
+#include "util.h"
+#include "log.h"
+#include "net.h"
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+int compress_level = 6;
+struct compress_stats compress_stats;
+
+int write_compress(int fd, int level)
+{
+  if (write_uint(fd, MSG_COMPRESS) < 0) return -1;
+  return write_uint(fd, level);
+}
+
+#if HAVE_ZLIB
+
+/* One pair of streams per connection; a process has one or two. */
+#define MAX_STREAMS 4
+static struct {
+  int fd;
+  z_stream out, in;
+} streams[MAX_STREAMS];
+static int streams_ready = 0;
+
+/* Mark every slot free, the first time we look. */
+static void streams_init_()
+{
+  int i;
+  if (streams_ready) return;
+  for (i = 0; i < MAX_STREAMS; ++i) streams[i].fd = -1;
+  streams_ready = 1;
+}
+
+static z_stream* stream_(int fd, int in)
+{
+  int i;
+  streams_init_();
+  for (i = 0; i < MAX_STREAMS; ++i)
+    if (streams[i].fd == fd && fd >= 0)
+      return in ? &streams[i].in : &streams[i].out;
+  return 0;
+}
+
+int compress_start(int fd, int level)
+{
+  int i;
+  if (level < 1) return -1;
+  if (level > 9) level = 9;
+  streams_init_();
+  for (i = 0; i < MAX_STREAMS && streams[i].fd >= 0; ++i)
+    ;
+  if (i == MAX_STREAMS) return -1;
+  memset(&streams[i].out, 0, sizeof(z_stream));
+  memset(&streams[i].in, 0, sizeof(z_stream));
+  if (deflateInit(&streams[i].out, level) != Z_OK) return -1;
+  if (inflateInit(&streams[i].in) != Z_OK) {
+    deflateEnd(&streams[i].out);
+    return -1;
+  }
+  streams[i].fd = fd;
+  return 0;
+}
+
+void compress_end(int fd)
+{
+  int i;
+  streams_init_();
+  for (i = 0; i < MAX_STREAMS; ++i) {
+    if (streams[i].fd != fd || fd < 0) continue;
+    deflateEnd(&streams[i].out);
+    inflateEnd(&streams[i].in);
+    streams[i].fd = -1;
+  }
+}
+
+int compress_active(int fd) { return stream_(fd, 0) != 0; }
+
+/* Room for what deflate adds to incompressible input: a stored block header
+ * per 16K or so, and the sync flush marker. */
+int bulk_chunk(int fd)
+{
+  if (!compress_active(fd)) return frame_max.send;
+  return frame_max.send - frame_max.send / 64 - 64;
+}
+
+int compress_frame(int fd, const char* buf, int len, char* out)
+{
+  z_stream* z = stream_(fd, 0);
+  if (!z) return -1;
+  z->next_in = (Bytef*)buf;
+  z->avail_in = len;
+  z->next_out = (Bytef*)out;
+  z->avail_out = frame_max.send;
+  if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in || !z->avail_out) {
+    logmsg(LOG_ERR, "compress_frame: deflate failed");
+    return -1;
+  }
+  compress_stats.raw += len;
+  compress_stats.packed += frame_max.send - z->avail_out;
+  return frame_max.send - z->avail_out;
+}
+
+char* read_zframe(int fd, int* msg, int* len)
+{
+  z_stream* z = stream_(fd, 1);
+  int packed_len, rv;
+  char *packed, *buf;
+  if ((*msg = read_uint(fd)) < 0) return 0;
+  if (!(packed = read_strn(fd, &packed_len))) return 0;
+  if (!z) {
+    logmsg(LOG_ERR, "read_zframe: compression was never agreed");
+    free(packed);
+    return 0;
+  }
+  if (!(buf = malloc(frame_max.recv + 1))) fatal("malloc()");
+  ++net_stats.allocs;
+  z->next_in = (Bytef*)packed;
+  z->avail_in = packed_len;
+  z->next_out = (Bytef*)buf;
+  z->avail_out = frame_max.recv + 1;
+  rv = inflate(z, Z_SYNC_FLUSH);
+  free(packed);
+  /* A frame never inflates past the limit it was sent under. Filling the
+   * byte beyond it means the frame was too big, or that inflate may still
+   * hold some of it, to turn up at the start of the next. */
+  if ((rv != Z_OK && rv != Z_BUF_ERROR) || z->avail_in || !z->avail_out) {
+    logmsg(LOG_ERR, "read_zframe: bad deflate stream");
+    free(buf);
+    return 0;
+  }
+  *len = frame_max.recv + 1 - z->avail_out;
+  buf[*len] = '\0';
+  return buf;
+}
+
+#else
+
+int compress_start(int fd, int level) { return -1; }
+void compress_end(int fd) { }
+int compress_active(int fd) { return 0; }
+int bulk_chunk(int fd) { return frame_max.send; }
+int compress_frame(int fd, const char* buf, int len, char* out)
+{ return -1; }
+
+char* read_zframe(int fd, int* msg, int* len)
+{
+  logmsg(LOG_ERR, "read_zframe: built without zlib");
+  return 0;
+}
+
+#endif
+
+int write_bulk(int fd, int channel, int job, int msg, const char* buf,
+               int len)
+{
+  static char* out = 0;
+  static int out_len = 0;
+  int chunk = bulk_chunk(fd), n, packed;
+  do {
+    n = len < chunk ? len : chunk;
+    if (job >= 0 ? write_job(fd, channel, job) < 0 :
+        channel >= 0 && write_channel(fd, channel) < 0)
+      return -1;
+    if (n < ZFRAME_MIN || !compress_active(fd)) {
+      if (write_uint(fd, msg) < 0 || write_strn(fd, buf, n) < 0) return -1;
+    } else {
+      if (out_len < frame_max.send) {
+        free(out);
+        if (!(out = malloc(frame_max.send))) fatal("malloc()");
+        out_len = frame_max.send;
+      }
+      if ((packed = compress_frame(fd, buf, n, out)) < 0 ||
+          write_uint(fd, MSG_ZFRAME) < 0 || write_uint(fd, msg) < 0 ||
+          write_strn(fd, out, packed) < 0)
+        return -1;
+    }
+    buf += n;
+    len -= n;
+  } while (len);
+  return 0;
+}
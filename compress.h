@@ -0,0 +1,67 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#ifndef COMPRESS_H__
+#define COMPRESS_H__
+
+/*
+ * Compression of bulk frames. The client asks for it with MSG_COMPRESS once
+ * the command loop starts, and the session answers with the level it agrees
+ * to, 0 for none. From then on, command output, command input and file
+ * contents of ZFRAME_MIN bytes or more go as MSG_ZFRAME: the id of the
+ * message they stand for (MSG_TEXT or MSG_DATA), then a segment of deflate
+ * stream ending at a sync flush. Each direction of a connection is a single
+ * stream, so each frame is compressed against everything sent before it.
+ * Nothing from before the command loop, like a password, is compressed.
+ * In the daemon, frames are only inflated in the process serving the
+ * command loop, which has become the user, never as root.
+ */
+#define ZFRAME_MIN 128
+
+/* The level to ask for, or the most the session will agree to. */
+extern int compress_level;
+
+int write_compress(int fd, int level);
+int compress_start(int fd, int level);
+void compress_end(int fd);
+int compress_active(int fd);
+
+/* The most payload that goes in one frame on fd. */
+int bulk_chunk(int fd);
+
+/* Deflate len bytes (up to bulk_chunk()) into out, which has room for a
+ * frame; returns the compressed length, or -1. */
+int compress_frame(int fd, const char* buf, int len, char* out);
+
+/* Send a payload as msg, split into frames and compressed if worthwhile,
+ * each frame tagged with channel and job, unless they are -1. */
+int write_bulk(int fd, int channel, int job, int msg, const char* buf,
+               int len);
+
+/* Having read MSG_ZFRAME, read the rest and inflate it. Returns the payload,
+ * NUL-terminated, with the id of the message it stands for in *msg. */
+char* read_zframe(int fd, int* msg, int* len);
+
+/* Bytes before and after deflating, for netbench. */
+struct compress_stats {
+  unsigned long long raw, packed;
+};
+extern struct compress_stats compress_stats;
+
+#endif
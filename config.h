@@ -0,0 +1,99 @@
+/* config.h.  Generated automatically by configure.  */
+/* Massively easier than writing autoconf to discover we need this for the
+ * right semantics. */
+#ifdef __hpux
+#define _POSIX_C_SOURCE 199506
+#endif
+
+/* Needed for getpwnam_r semantics */
+/* #undef _POSIX_PTHREAD_SEMANTICS */
+
+/* Define as 1 if you have <bsm/audit.h> */
+#define HAVE_BSM_AUDIT_H 0
+
+/* Define as 1 if you have <bsm/libbsm.h> */
+#define HAVE_BSM_LIBBSM_H 0
+
+/* Define as 1 if you have <lastlog.h> */
+#define HAVE_LASTLOG_H 1
+
+/* Define as 1 if you have <linux/sched.h> */
+#define HAVE_LINUX_SCHED_H 1
+
+/* Define as 1 if you have <pam/pam_appl.h> */
+#define HAVE_PAM_PAM_APPL_H 0
+
+/* Define as 1 if you have <security/pam_appl.h> */
+#define HAVE_SECURITY_PAM_APPL_H 0
+
+/* Define as 1 if you have <sys/sendfile.h> */
+#define HAVE_SYS_SENDFILE_H 1
+
+/* Define as 1 if you have <utmpx.h> */
+#define HAVE_UTMPX_H 1
+
+/* Define as 1 if we are using PAM */
+#define HAVE_PAM 0
+
+/* Define as 1 if you have pam_getenvlist */
+#define HAVE_PAM_GETENVLIST 0
+
+/* Define as 1 if we can compress with zlib */
+#define HAVE_ZLIB 1
+
+/* Define as 1 if you have libproject */
+#define HAVE_LIBPROJECT 0
+
+/* Define as 1 if you have the login capabilities database */
+#define HAVE_LOGIN_CAP 0
+
+/* Define as 1 if you have chroot */
+#define HAVE_CHROOT 1
+
+/* Define as 1 if you have closefrom */
+#define HAVE_CLOSEFROM 1
+
+/* Define as 1 if you have getpeereid */
+#define HAVE_GETPEEREID 0
+
+/* Define as 1 if you have posix_openpt */
+#define HAVE_POSIX_OPENPT 1
+
+/* Define as 1 if you have psignal */
+#define HAVE_PSIGNAL 1
+
+/* Define as 1 if you have pstat_getproc */
+#define HAVE_PSTAT_GETPROC 0
+
+/* Define as 1 if you have sendfile */
+#define HAVE_SENDFILE 1
+
+/* Define as 1 if you have setenv */
+#define HAVE_SETENV 1
+
+/* Define as 1 if you have setlogin */
+#define HAVE_SETLOGIN 0
+
+/* Define as 1 if you have setpcred */
+#define HAVE_SETPCRED 0
+
+/* Define as 1 if you have setproctitle */
+#define HAVE_SETPROCTITLE 0
+
+/* Define as 1 if you have setreuid */
+#define HAVE_SETREUID 1
+
+/* Define as 1 if you have setresuid */
+#define HAVE_SETRESUID 1
+
+/* Define as 1 if you have splice */
+#define HAVE_SPLICE 1
+
+/* Define as 1 if you have strlcpy */
+#define HAVE_STRLCPY 0
+
+/* Define as 1 if you have updwtmpx */
+#define HAVE_UPDWTMPX 1
+
+/* Define as 1 if you have usrinfo */
+#define HAVE_USRINFO 0
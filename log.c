@@ -0,0 +1,210 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#include "log.h"
+#include "util.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef SOCK_SEQPACKET
+#define SOCK_SEQPACKET SOCK_DGRAM
+#endif
+
+#define LOG_RECORD_MAX 1024
+#define LOG_BATCH_MAX (64*1024)
+
+static int log_fd = -1;
+static unsigned log_conn = 0, log_dropped = 0;
+static const char* log_phase = "listen";
+
+static const char* level_name(int level)
+{
+  switch (level) {
+  case LOG_EMERG: case LOG_ALERT: case LOG_CRIT: return "crit";
+  case LOG_ERR: return "err";
+  case LOG_WARNING: return "warning";
+  case LOG_NOTICE: return "notice";
+  case LOG_INFO: return "info";
+  default: return "debug";
+  }
+}
+
+/* The writer: drain whatever is queued, then make one write for the whole
+ * batch. syslog() takes records one at a time (see log.h), so those go as
+ * they come. Exits once every sender has gone. */
+static void log_writer(int fd, const char* file)
+{
+  static char batch[LOG_BATCH_MAX];
+  char rec[LOG_RECORD_MAX];
+  int out = -1, eof = 0;
+
+  setproctitle("[log]");
+  if (file) {
+    out = open(file, O_WRONLY|O_APPEND|O_CREAT, 0600);
+    if (out < 0) { perror("log_writer:open()"); _exit(1); }
+  } else {
+    openlog("netlogind", LOG_NDELAY, LOG_DAEMON);
+  }
+
+  while (!eof) {
+    int len = 0, flags = 0;
+    while (len + LOG_RECORD_MAX + 1 <= (int)sizeof(batch)) {
+      ssize_t n = recv(fd, rec, sizeof(rec), flags);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if (n <= 0) { eof = 1; break; }
+      flags = MSG_DONTWAIT;
+      if (n < 2) continue;
+      if (out < 0) {
+        syslog(rec[0], "%.*s", (int)n-1, rec+1);
+        continue;
+      }
+      memcpy(batch+len, rec+1, n-1);
+      len += n-1;
+      batch[len++] = '\n';
+    }
+    char* p = batch;
+    while (len > 0) {
+      ssize_t n = write(out, p, len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) break; /* nowhere left to report it */
+      len -= n;
+      p += n;
+    }
+  }
+  _exit(0);
+}
+
+void log_open(const char* file)
+{
+  int fd[2];
+  if (socketpair(PF_UNIX, SOCK_SEQPACKET, 0, fd) < 0)
+    perror_fatal("log_open:socketpair()");
+  fflush(0);
+  int rv = fork();
+  if (rv < 0) perror_fatal("log_open:fork()");
+  if (rv == 0) {
+    (void)close(fd[1]);
+    log_writer(fd[0], file);
+  }
+  (void)close(fd[0]);
+  (void)fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+  log_fd = fd[1];
+}
+
+int log_handoff()
+{
+  if (log_fd >= 0) (void)fcntl(log_fd, F_SETFD, 0);
+  return log_fd;
+}
+
+void log_adopt(int fd)
+{
+  if (fd >= 0) (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+  log_fd = fd;
+}
+
+void log_close()
+{
+  if (log_fd >= 0) (void)close(log_fd);
+  log_fd = -1;
+}
+
+void log_set_conn(unsigned id) { log_conn = id; }
+void log_set_phase(const char* phase) { log_phase = phase; }
+
+static void log_emit(int level, int quote, const char* fmt, va_list ap)
+{
+  char rec[LOG_RECORD_MAX], text[LOG_RECORD_MAX];
+  int saved_errno = errno;
+
+  vsnprintf(text, sizeof(text), fmt, ap);
+  if (log_fd < 0) {
+    fprintf(stderr, "%s\n", text);
+    errno = saved_errno;
+    return;
+  }
+
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  int n = 1;
+  rec[0] = (char)level;
+  n += snprintf(rec+n, sizeof(rec)-n,
+                "ts=%ld.%03d level=%s pid=%ld conn=%u phase=%s ",
+                (long)tv.tv_sec, (int)(tv.tv_usec/1000), level_name(level),
+                (long)getpid(), log_conn, log_phase);
+  if (log_dropped)
+    n += snprintf(rec+n, sizeof(rec)-n, "dropped=%u ", log_dropped);
+  if (n >= (int)sizeof(rec)) n = sizeof(rec)-1;
+
+  const char* s = text;
+  if (quote && n < (int)sizeof(rec)-5) {
+    memcpy(rec+n, "msg=\"", 5);
+    n += 5;
+  }
+  for (; *s && n < (int)sizeof(rec)-3; ++s) {
+    char c = *s;
+    if (c == '\n' && !s[1]) break;
+    if (quote && (c == '"' || c == '\\')) rec[n++] = '\\';
+    rec[n++] = (c == '\n' || c == '\r') ? ' ' : c;
+  }
+  if (quote) rec[n++] = '"';
+
+  while (send(log_fd, rec, n, MSG_DONTWAIT|MSG_NOSIGNAL) < 0) {
+    if (errno == EINTR) continue;
+    ++log_dropped;
+    errno = saved_errno;
+    return;
+  }
+  log_dropped = 0;
+  errno = saved_errno;
+}
+
+void vlogmsg(int level, const char* fmt, va_list ap)
+{ log_emit(level, 1, fmt, ap); }
+
+void logmsg(int level, const char* fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  log_emit(level, 1, fmt, ap);
+  va_end(ap);
+}
+
+void logkv(int level, const char* fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  log_emit(level, 0, fmt, ap);
+  va_end(ap);
+}
+
+void log_perror(const char* str)
+{ logmsg(LOG_ERR, "%s: %s", str, strerror(errno)); }
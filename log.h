@@ -0,0 +1,54 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#ifndef LOG_H__
+#define LOG_H__
+
+#include <stdarg.h>
+#include <syslog.h>
+
+/*
+ * Structured logging. Each record is a line of key=value fields, tagged with
+ * the pid, connection id and phase of the process that emitted it.
+ *
+ * After log_open(), records are handed to a separate [log] writer process
+ * over a packet socket, which drains them in batches: a file gets one write
+ * per batch. syslog gets one syslog() call per record all the same, since
+ * each is a datagram of its own to the system logger, with its own priority;
+ * joining them would merge records in the log. Sending never blocks: if the
+ * writer falls behind, records are dropped and counted, so a slow sink can't
+ * stall authentication. Before log_open() (or in the client), records go
+ * straight to stderr.
+ */
+void log_open(const char* file);
+void log_close();
+/* Across a restart's exec, the writer carries on: log_handoff() returns its
+ * socket, left open for the new image, which takes it up with log_adopt(). */
+int log_handoff();
+void log_adopt(int fd);
+void log_set_conn(unsigned id);
+void log_set_phase(const char* phase);
+
+/* logmsg() quotes its text as msg="..."; logkv() takes raw key=value pairs. */
+void logmsg(int level, const char* fmt, ...);
+void vlogmsg(int level, const char* fmt, va_list ap);
+void logkv(int level, const char* fmt, ...);
+void log_perror(const char* str);
+
+#endif
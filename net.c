@@ -17,13 +17,22 @@
   SOFTWARE.
  */
 
+#ifdef __linux
+#define _GNU_SOURCE /* for struct ucred */
+#endif
+
 #include "net.h"
 #include "util.h"
+#include "log.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <unistd.h>
 
 #include <stdlib.h>
@@ -32,11 +41,44 @@
 #include <errno.h>
 #include <limits.h>
 
-/* An int has the right width on every modern platform. */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* An int has the right width on every modern platform. Integers go over the
+ * wire in network byte order, since TCP peers needn't share our endianness. */
 typedef unsigned int uint32_net;
 typedef char static_assert1[sizeof(uint32_net)*2 - 7];
 typedef char static_assert2[9 - sizeof(uint32_net)*2];
 
+struct net_opts net_opts = { 5, 0, 0, 0 };
+struct net_stats net_stats;
+struct frame_max frame_max = { FRAME_DEFAULT, FRAME_MIN };
+
+void set_frame_max(int* limit, int size)
+{ *limit = size < FRAME_MIN ? FRAME_MIN : size; }
+
+int flow_window = WINDOW_DEFAULT;
+
+void set_flow_window(int size)
+{ flow_window = size < WINDOW_MIN ? WINDOW_MIN : size; }
+
+static void setsockopts_(int fd)
+{
+  int one = 1;
+  if (net_opts.keepalive &&
+      setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) < 0)
+    log_perror("setsockopt(SO_KEEPALIVE)");
+  if (net_opts.sndbuf &&
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &net_opts.sndbuf,
+                 sizeof(net_opts.sndbuf)) < 0)
+    log_perror("setsockopt(SO_SNDBUF)");
+  if (net_opts.rcvbuf &&
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &net_opts.rcvbuf,
+                 sizeof(net_opts.rcvbuf)) < 0)
+    log_perror("setsockopt(SO_RCVBUF)");
+}
+
 int is_un_connectable(const char* sock)
 {
   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -64,11 +106,12 @@ int un_listen(const char* sock)
   assert(strlcpy(addr.sun_path, sock, sizeof(addr.sun_path)) <
            sizeof(addr.sun_path));
   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-  { close(fd); perror("un_listen:bind()"); return -1; }
-  if (listen(fd, 5) < 0)
-  { close(fd); perror("un_listen:listen()"); return -1; }
+  { close(fd); log_perror("un_listen:bind()"); return -1; }
+  setsockopts_(fd);
+  if (listen(fd, net_opts.backlog) < 0)
+  { close(fd); log_perror("un_listen:listen()"); return -1; }
   if (chmod(sock, 0666) < 0)
-  { close(fd); perror("un_listen:chmod()"); return -1; }
+  { close(fd); log_perror("un_listen:chmod()"); return -1; }
   return fd;
 }
 
@@ -76,28 +119,237 @@ int un_connect(const char* sock)
 {
   struct sockaddr_un addr;
   int rv, fd = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (fd < 0) perror_fatal("un_connect:socket()");
+  if (fd < 0) { log_perror("un_connect:socket()"); return -1; }
   addr.sun_family = AF_UNIX;
   assert(strlcpy(addr.sun_path, sock, sizeof(addr.sun_path)) <
            sizeof(addr.sun_path));
   rv = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
-  if (rv < 0) { perror("un_connect:connect()"); close(fd); return -1; }
+  if (rv < 0) { log_perror("un_connect:connect()"); close(fd); return -1; }
+  return fd;
+}
+
+static struct addrinfo* tcp_resolve(const char* addr, int passive)
+{
+  char host[256];
+  const char* port = strrchr(addr, ':');
+  struct addrinfo hints, *res = 0;
+  int rv;
+
+  if (port) {
+    size_t len = port - addr;
+    if (len > 1 && addr[0] == '[' && addr[len-1] == ']') { ++addr; len -= 2; }
+    if (len >= sizeof(host)) {
+      logmsg(LOG_ERR, "tcp_resolve: host name too long");
+      return 0;
+    }
+    memcpy(host, addr, len);
+    host[len] = '\0';
+    ++port;
+  } else {
+    host[0] = '\0';
+    port = addr;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (passive) hints.ai_flags = AI_PASSIVE;
+  rv = getaddrinfo(host[0] ? host : 0, port, &hints, &res);
+  if (rv) {
+    logmsg(LOG_ERR, "getaddrinfo(%s): %s", addr, gai_strerror(rv));
+    return 0;
+  }
+  return res;
+}
+
+void tcp_setsockopts(int fd)
+{
+  int one = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+    log_perror("setsockopt(TCP_NODELAY)");
+  setsockopts_(fd);
+}
+
+int is_listening(int fd)
+{
+#ifdef SO_ACCEPTCONN
+  int on = 0;
+  socklen_t len = sizeof(on);
+  return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == 0 && on;
+#else
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  return getsockname(fd, (struct sockaddr*)&addr, &len) == 0;
+#endif
+}
+
+int is_tcp(int fd)
+{
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  return getsockname(fd, (struct sockaddr*)&addr, &len) == 0 &&
+         addr.ss_family != AF_UNIX;
+}
+
+int tcp_listen(const char* addr)
+{
+  struct addrinfo *res = tcp_resolve(addr, 1), *ai;
+  int fd = -1, one = 1;
+  if (!res) return -1;
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) continue;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+      log_perror("tcp_listen:setsockopt(SO_REUSEADDR)");
+    tcp_setsockopts(fd);
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+        listen(fd, net_opts.backlog) == 0)
+      break;
+    log_perror("tcp_listen:bind()");
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+int tcp_connect(const char* addr)
+{
+  struct addrinfo *res = tcp_resolve(addr, 0), *ai;
+  int fd = -1;
+  if (!res) return -1;
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) continue;
+    tcp_setsockopts(fd);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+    log_perror("tcp_connect:connect()");
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+int peer_uid(int fd, uid_t* uid)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  if (getsockname(fd, (struct sockaddr*)&addr, &addrlen) < 0) return -1;
+  if (addr.ss_family != AF_UNIX) { errno = EAFNOSUPPORT; return -1; }
+#if HAVE_GETPEEREID
+  gid_t gid;
+  return getpeereid(fd, uid, &gid);
+#elif defined(SO_PEERCRED)
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return -1;
+  *uid = cred.uid;
+  return 0;
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+void peer_host(int fd, char* buf, size_t len)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  buf[0] = '\0';
+  if (getpeername(fd, (struct sockaddr*)&addr, &addrlen) < 0 ||
+      addr.ss_family == AF_UNIX)
+    return;
+  if (getnameinfo((struct sockaddr*)&addr, addrlen, buf, len, 0, 0,
+                  NI_NUMERICHOST) != 0)
+    buf[0] = '\0';
+}
+
+int send_fd(int sock, int fd)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int))]; } cmsg;
+  char c = 0;
+  memset(&msg, 0, sizeof(msg));
+  memset(&cmsg, 0, sizeof(cmsg));
+  iov.iov_base = &c;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg.buf;
+  msg.msg_controllen = sizeof(cmsg.buf);
+  cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+  cmsg.hdr.cmsg_level = SOL_SOCKET;
+  cmsg.hdr.cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+  while (sendmsg(sock, &msg, 0) < 0) {
+    if (errno == EINTR) continue;
+    log_perror("send_fd:sendmsg()");
+    return -1;
+  }
+  return 0;
+}
+
+int recv_fd(int sock)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int))]; } cmsg;
+  struct cmsghdr* hdr;
+  char c;
+  int fd = -1;
+  ssize_t n;
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &c;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg.buf;
+  msg.msg_controllen = sizeof(cmsg.buf);
+  while ((n = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+    ;
+  if (n < 0) { log_perror("recv_fd:recvmsg()"); return -1; }
+  if (n == 0) return -1;
+  for (hdr = CMSG_FIRSTHDR(&msg); hdr; hdr = CMSG_NXTHDR(&msg, hdr)) {
+    if (hdr->cmsg_level == SOL_SOCKET && hdr->cmsg_type == SCM_RIGHTS)
+      memcpy(&fd, CMSG_DATA(hdr), sizeof(int));
+  }
+  if (fd < 0) logmsg(LOG_ERR, "recv_fd: no descriptor received");
   return fd;
 }
 
+static int tap_fd = -1;
+static void (*tap_fn)(int out, const void* buf, int len) = 0;
+
+void net_set_tap(int fd, void (*tap)(int out, const void* buf, int len))
+{
+  tap_fd = tap ? fd : -1;
+  tap_fn = tap;
+}
+
+int net_tapped(int fd) { return fd >= 0 && fd == tap_fd; }
+
+void net_tap(int fd, int out, const void* buf, int len)
+{
+  if (fd == tap_fd && tap_fn && len > 0) tap_fn(out, buf, len);
+}
+
 static int readbuf_(int fd, void* buf_, int len)
 {
   char* buf = (char*)buf_;
   while(len) {
     int err = read(fd, buf, len);
+    ++net_stats.reads;
     if (err < 0 && errno == EINTR) continue;
-    if (err < 0) { perror("read()"); return -1; }
+    if (err < 0) { log_perror("read()"); return -1; }
     if (err == 0) { break; }
+    net_tap(fd, 0, buf, err);
     len -= err;
     buf += err;
   }
   if (len) {
-    fprintf(stderr, "incomplete readbuf()\n");
+    logmsg(LOG_ERR, "incomplete readbuf()");
     return -1;
   }
   return 0;
@@ -108,14 +360,27 @@ static int writebuf_(int fd, const void* buf_, int len)
   const char* buf = (const char*)buf_;
   while(len) {
     int err = write(fd, buf, len);
+    ++net_stats.writes;
     if (err < 0 && errno == EINTR) continue;
-    if (err < 0) { perror("write()"); return -1; }
+    if (err < 0) { log_perror("write()"); return -1; }
+    net_tap(fd, 1, buf, err);
     len -= err;
     buf += err;
   }
   return 0;
 }
 
+const char* msg_name(int msg)
+{
+  static const char* const names[] = {
+    "?", "FINISH", "TEXT", "PROMPT", "REPLY", "CHANNEL", "OPEN", "RESUME",
+    "TICKET", "MAXFRAME", "GET", "PUT", "DATA", "PROGRESS", "PTY", "WINCH",
+    "WINDOW", "ZFRAME", "COMPRESS", "JOB", "EXIT"
+  };
+  if (msg < 0 || msg >= (int)(sizeof(names)/sizeof(names[0]))) msg = 0;
+  return names[msg];
+}
+
 int write_finish(int fd, int status)
 {
   if (write_uint(fd, MSG_FINISH) < 0) return -1;
@@ -136,16 +401,126 @@ int write_reply(int fd, const char* str)
   if (write_uint(fd, MSG_REPLY) < 0) return -1;
   return write_str(fd, str);
 }
+int write_resume(int fd, const char* ticket)
+{
+  if (write_uint(fd, MSG_RESUME) < 0) return -1;
+  return write_str(fd, ticket);
+}
+int write_ticket(int fd, const char* ticket)
+{
+  if (write_uint(fd, MSG_TICKET) < 0) return -1;
+  return write_str(fd, ticket);
+}
+int write_textn(int fd, const char* buf, int len)
+{
+  do {
+    int n = len < frame_max.send ? len : frame_max.send;
+    if (write_uint(fd, MSG_TEXT) < 0 || write_strn(fd, buf, n) < 0)
+      return -1;
+    buf += n;
+    len -= n;
+  } while (len);
+  return 0;
+}
+int write_data(int fd, const char* buf, int len)
+{
+  if (write_uint(fd, MSG_DATA) < 0) return -1;
+  return write_strn(fd, buf, len);
+}
+int write_winsize(int fd, int msg, int rows, int cols)
+{
+  if (write_uint(fd, msg) < 0 || write_uint(fd, rows) < 0) return -1;
+  return write_uint(fd, cols);
+}
+int write_window(int fd, int channel, int bytes)
+{
+  if (write_channel(fd, channel) < 0 || write_uint(fd, MSG_WINDOW) < 0)
+    return -1;
+  return write_uint(fd, bytes);
+}
+int write_job(int fd, int channel, int job)
+{
+  if (write_channel(fd, channel) < 0 || write_uint(fd, MSG_JOB) < 0) return -1;
+  return write_uint(fd, job);
+}
+int write_exit(int fd, int channel, int job, int status)
+{
+  if (write_job(fd, channel, job) < 0 || write_uint(fd, MSG_EXIT) < 0)
+    return -1;
+  return write_uint(fd, status);
+}
+int write_channel(int fd, int channel)
+{
+  if (write_uint(fd, MSG_CHANNEL) < 0) return -1;
+  return write_uint(fd, channel);
+}
+int write_open(int fd, int channel)
+{
+  if (write_uint(fd, MSG_OPEN) < 0) return -1;
+  return write_uint(fd, channel);
+}
+int write_maxframe(int fd, int size)
+{
+  if (write_uint(fd, MSG_MAXFRAME) < 0) return -1;
+  return write_uint(fd, size);
+}
+int write_uint64(int fd, unsigned long long i)
+{
+  uint32_net w[2];
+  w[0] = htonl((uint32_net)(i >> 32));
+  w[1] = htonl((uint32_net)i);
+  return writebuf_(fd, w, sizeof(w));
+}
+int read_uint64(int fd, unsigned long long* i)
+{
+  uint32_net w[2];
+  if (readbuf_(fd, w, sizeof(w)) < 0) return -1;
+  *i = (unsigned long long)ntohl(w[0]) << 32 | ntohl(w[1]);
+  return 0;
+}
+int write_get(int fd, unsigned long long offset, const char* path)
+{
+  if (write_uint(fd, MSG_GET) < 0 || write_uint64(fd, offset) < 0) return -1;
+  return write_str(fd, path);
+}
+int write_put(int fd, unsigned long long offset, unsigned long long size,
+              const char* path)
+{
+  if (write_uint(fd, MSG_PUT) < 0 || write_uint64(fd, offset) < 0 ||
+      write_uint64(fd, size) < 0)
+    return -1;
+  return write_str(fd, path);
+}
+int write_progress(int fd, unsigned long long done, unsigned long long size)
+{
+  if (write_uint(fd, MSG_PROGRESS) < 0 || write_uint64(fd, done) < 0)
+    return -1;
+  return write_uint64(fd, size);
+}
 int write_str(int fd, const char* str)
 {
   size_t len = strlen(str);
   if (len > INT_MAX) len = INT_MAX;
-  if (write_uint(fd, (int)len) < 0) return -1;
-  return writebuf_(fd, str, (int)len);
+  return write_strn(fd, str, (int)len);
+}
+int write_raw(int fd, const void* buf, int len)
+{ return writebuf_(fd, buf, len); }
+static int write_frame_(int fd, const char* buf, int len)
+{
+  if (write_uint(fd, len) < 0) return -1;
+  return writebuf_(fd, buf, len);
+}
+int write_strn(int fd, const char* buf, int len)
+{
+  if (len > frame_max.send) {
+    logmsg(LOG_ERR, "write_strn: %d bytes exceeds peer's frame limit", len);
+    return -1;
+  }
+  return write_frame_(fd, buf, len);
 }
 int write_uint(int fd, int i_)
 {
-  uint32_net i = (uint32_net)i_;
+  uint32_net i = htonl((uint32_net)i_);
   assert(i_ >= 0);
   return writebuf_(fd, &i, sizeof(i));
 }
@@ -157,10 +532,20 @@ char* read_reply(int fd)
 }
 char* read_str(int fd)
 {
-  int len = read_uint(fd);
+  int len;
+  return read_strn(fd, &len);
+}
+char* read_strn(int fd, int* len_)
+{
+  int len = *len_ = read_uint(fd);
   if (len < 0) return 0;
+  if (len > frame_max.recv) {
+    logmsg(LOG_ERR, "read_strn: %d byte frame exceeds limit", len);
+    return 0;
+  }
   char* buf = malloc(len+1);
   if (!buf) { fatal("malloc()"); assert(0); }
+  ++net_stats.allocs;
   buf[len] = '\0';
   if (readbuf_(fd, buf, len) < 0)
   { buffer_scrub(buf, len); free(buf); return 0; }
@@ -170,6 +555,171 @@ int read_uint(int fd)
 {
   uint32_net i;
   if (readbuf_(fd, &i, sizeof(i)) < 0) return -1;
+  i = ntohl(i);
   if (i > INT_MAX) return -1;
   return (int)i;
 }
+
+int read_nb_msg(int fd, struct nb_msg* m)
+{
+  uint32_net hdr[2];
+  while (1) {
+    int want;
+    if (m->len < (int)sizeof(hdr)) {
+      want = sizeof(hdr) - m->len;
+    } else {
+      memcpy(hdr, m->buf, sizeof(hdr));
+      if (ntohl(hdr[1]) > NB_MSG_MAX) return -1;
+      want = sizeof(hdr) + ntohl(hdr[1]) - m->len;
+      if (!want) {
+        m->msg = (int)ntohl(hdr[0]);
+        m->buf[m->len] = '\0';
+        m->str = m->buf + sizeof(hdr);
+        return 1;
+      }
+    }
+    ssize_t n = read(fd, m->buf + m->len, want);
+    ++net_stats.reads;
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) return -1;
+    net_tap(fd, 0, m->buf + m->len, n);
+    m->len += n;
+  }
+}
+
+static int msg_buf_reserve_(struct msg_buf* b, int len)
+{
+  if (b->failed) return -1;
+  if (b->len + len <= b->cap) return 0;
+  int cap = b->cap ? b->cap : 256;
+  while (cap < b->len + len) cap *= 2;
+  char* buf = malloc(cap);
+  if (!buf) {
+    logmsg(LOG_ERR, "msg_buf: out of memory");
+    b->failed = 1;
+    return -1;
+  }
+  ++net_stats.allocs;
+  if (b->buf) {
+    memcpy(buf, b->buf, b->len);
+    buffer_scrub(b->buf, b->cap);
+    free(b->buf);
+  }
+  b->buf = buf;
+  b->cap = cap;
+  return 0;
+}
+
+int msg_buf_put(struct msg_buf* b, const void* buf, int len)
+{
+  if (msg_buf_reserve_(b, len) < 0) return -1;
+  memcpy(b->buf + b->len, buf, len);
+  b->len += len;
+  return 0;
+}
+
+int msg_buf_put_uint(struct msg_buf* b, int i_)
+{
+  uint32_net i = htonl((uint32_net)i_);
+  assert(i_ >= 0);
+  return msg_buf_put(b, &i, sizeof(i));
+}
+
+static int msg_buf_copy_(int from, struct msg_buf* b, int len)
+{
+  if (msg_buf_reserve_(b, len) < 0 ||
+      readbuf_(from, b->buf + b->len, len) < 0)
+    return -1;
+  b->len += len;
+  return 0;
+}
+
+int msg_buf_read(int from, int msg, unsigned allowed, struct msg_buf* b)
+{
+  int u;
+  if (msg < 0) return -1;
+  if (msg >= 32 || !(allowed & MSG_MASK(msg))) {
+    logmsg(LOG_ERR, "relay_msg: unexpected message id %d", msg);
+    return -1;
+  }
+  if (msg_buf_put_uint(b, msg) < 0) return -1;
+  switch (msg) {
+  case MSG_FINISH:
+  case MSG_PROMPT:
+  case MSG_OPEN:
+  case MSG_MAXFRAME:
+  case MSG_WINDOW:
+  case MSG_COMPRESS:
+  case MSG_EXIT:
+    if ((u = read_uint(from)) < 0 || msg_buf_put_uint(b, u) < 0) return -1;
+    return msg;
+  case MSG_PROGRESS:
+    return msg_buf_copy_(from, b, 16) < 0 ? -1 : msg;
+  case MSG_PTY:
+  case MSG_WINCH:
+    return msg_buf_copy_(from, b, 8) < 0 ? -1 : msg;
+  case MSG_ZFRAME:
+  case MSG_GET:
+  case MSG_PUT:
+    if (msg_buf_copy_(from, b, msg == MSG_PUT ? 16 :
+                               msg == MSG_GET ? 8 : 4) < 0)
+      return -1;
+    /* Then the path, or the compressed payload. */
+    /* fall through */
+  case MSG_TEXT:
+  case MSG_REPLY:
+  case MSG_RESUME:
+  case MSG_TICKET:
+  case MSG_DATA:
+    /* Bounded by our own limit on the way in; it's for the ends of the
+     * connection to respect each other's. */
+    if ((u = read_uint(from)) < 0) return -1;
+    if (u > frame_max.recv) {
+      logmsg(LOG_ERR, "relay_msg: %d byte frame exceeds limit", u);
+      return -1;
+    }
+    if (msg_buf_put_uint(b, u) < 0) return -1;
+    return msg_buf_copy_(from, b, u) < 0 ? -1 : msg;
+  case MSG_CHANNEL:
+  case MSG_JOB:
+    /* A tag, then the message it applies to. A job's is inside a channel's. */
+    if ((u = read_uint(from)) < 0 || msg_buf_put_uint(b, u) < 0) return -1;
+    allowed &= ~MSG_MASK(msg) & ~MSG_MASK(MSG_CHANNEL);
+    if (msg_buf_read(from, read_msg_type(from), allowed, b) < 0)
+      return -1;
+    return msg;
+  default:
+    logmsg(LOG_ERR, "relay_msg: unknown message id %d", msg);
+    return -1;
+  }
+}
+
+int msg_buf_flush(int to, struct msg_buf* b)
+{
+  if (b->failed) return -1;
+  while (b->off < b->len) {
+    ssize_t n = send(to, b->buf + b->off, b->len - b->off,
+                     MSG_DONTWAIT|MSG_NOSIGNAL);
+    ++net_stats.writes;
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n < 0) { log_perror("send()"); return -1; }
+    net_tap(to, 1, b->buf + b->off, n);
+    b->off += n;
+  }
+  /* Replies may be passwords. */
+  buffer_scrub(b->buf, b->len);
+  b->len = b->off = 0;
+  return 1;
+}
+
+int relay_msg(int from, int to, int msg, unsigned allowed)
+{
+  static struct msg_buf b;
+  int rv = msg_buf_read(from, msg, allowed, &b);
+  if (rv >= 0 && writebuf_(to, b.buf, b.len) < 0) rv = -1;
+  buffer_scrub(b.buf, b.len);
+  b.len = b.off = 0;
+  return rv;
+}
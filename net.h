@@ -20,14 +20,110 @@
 #ifndef NET_H__
 #define NET_H__
 
+#include <sys/types.h>
+
+/* Socket options applied to every listener and connection we create. A zero
+ * buffer size leaves the system default alone. */
+struct net_opts {
+  int backlog;
+  int keepalive;
+  int sndbuf, rcvbuf;
+};
+extern struct net_opts net_opts;
+
+/* Where the daemon listens, and clients connect, unless told otherwise. */
+#define SOCK_NAME "/tmp/netlogind.sock"
 int is_un_connectable(const char* sock);
 int un_listen(const char* sock);
 int un_connect(const char* sock);
 
+/* TCP addresses are "[host:]port"; IPv6 hosts may be written "[addr]:port".
+ * Listening with no host binds the wildcard address; connecting with no host
+ * goes to the loopback. */
+int tcp_listen(const char* addr);
+int tcp_connect(const char* addr);
+void tcp_setsockopts(int fd);
+
+/* For sockets handed to us by a launcher (inetd, systemd): whether fd is a
+ * listening socket, and whether it's TCP rather than UNIX. */
+int is_listening(int fd);
+int is_tcp(int fd);
+
+/* The kernel-verified uid of the process at the other end of a UNIX socket.
+ * Fails for TCP sockets, or where the platform can't tell us. */
+int peer_uid(int fd, uid_t* uid);
+/* The numeric address of a TCP peer, or "" for a UNIX socket. */
+void peer_host(int fd, char* buf, size_t len);
+
+/* Pass an open descriptor over a UNIX socket (SCM_RIGHTS). */
+int send_fd(int sock, int fd);
+int recv_fd(int sock);
+
 #define MSG_FINISH 1
 #define MSG_TEXT 2
 #define MSG_PROMPT 3
 #define MSG_REPLY 4
+#define MSG_CHANNEL 5
+#define MSG_OPEN 6
+#define MSG_RESUME 7
+#define MSG_TICKET 8
+#define MSG_MAXFRAME 9
+#define MSG_GET 10
+#define MSG_PUT 11
+#define MSG_DATA 12
+#define MSG_PROGRESS 13
+#define MSG_PTY 14
+#define MSG_WINCH 15
+#define MSG_WINDOW 16
+#define MSG_ZFRAME 17
+#define MSG_COMPRESS 18
+#define MSG_JOB 19
+#define MSG_EXIT 20
+/* "TEXT" for MSG_TEXT, and so on, for diagnostics. */
+const char* msg_name(int msg);
+
+/*
+ * Frame sizes. read_strn() refuses any payload longer than frame_max.recv,
+ * so that one message can't make us allocate more than that. Each side
+ * announces its own limit with MSG_MAXFRAME; until it has heard the other's,
+ * it sends nothing longer than FRAME_MIN. write_textn() splits longer output
+ * into a run of MSG_TEXT fragments, which the reader takes one at a time.
+ */
+#define FRAME_MIN 4096
+#define FRAME_DEFAULT (64*1024)
+struct frame_max {
+  int recv, send;
+};
+extern struct frame_max frame_max;
+void set_frame_max(int* limit, int size);
+int write_maxframe(int fd, int size);
+
+/*
+ * Flow control. A command's output and its input each flow on their
+ * channel against credit: the reader grants a window of bytes with
+ * MSG_WINDOW, and tops it up as it consumes them, so neither end queues
+ * more than flow_window bytes for a stream, however slow the other is.
+ * Credit starts at nothing, so the reader must make the first grant.
+ */
+#define WINDOW_MIN FRAME_MIN
+#define WINDOW_DEFAULT (256*1024)
+extern int flow_window;
+void set_flow_window(int size);
+
+/* Running totals of the read()/write() calls and buffer allocations made by
+ * the codec below, for netbench. */
+struct net_stats {
+  unsigned long reads, writes, allocs;
+};
+extern struct net_stats net_stats;
+
+/* A tap on one socket, which is shown every byte read from it (out = 0) or
+ * written to it (out = 1), for recording transcripts (see record.h). Code
+ * that moves bytes around the codec calls net_tap() itself, and doesn't
+ * bypass userspace (sendfile, splice) on a tapped socket. */
+void net_set_tap(int fd, void (*tap)(int out, const void* buf, int len));
+int net_tapped(int fd);
+void net_tap(int fd, int out, const void* buf, int len);
 
 /*
  * Blindingly simple blocking, unbuffered network layer.
@@ -39,6 +135,8 @@ int write_finish(int fd, int status);
 int write_text(int fd, const char* str);
 int write_prompt(int fd, int echo);
 int write_reply(int fd, const char* str);
+int write_resume(int fd, const char* ticket);
+int write_ticket(int fd, const char* ticket);
 int write_str(int fd, const char* str);
 int write_uint(int fd, int i);
 int read_msg_type(int fd);
@@ -46,4 +144,92 @@ char* read_reply(int fd);
 char* read_str(int fd);
 int read_uint(int fd);
 
+/* Counted strings, for command output that may contain NULs. read_strn()
+ * still NUL-terminates its result. */
+int write_textn(int fd, const char* buf, int len);
+int write_strn(int fd, const char* buf, int len);
+char* read_strn(int fd, int* len);
+
+/*
+ * Channels. After authentication, every message is prefixed by MSG_CHANNEL
+ * and a channel number, so that several command streams can share the one
+ * connection. Channel 0 exists from the start; the client asks for others
+ * with MSG_OPEN. A MSG_FINISH inside a channel closes it, and an untagged
+ * MSG_FINISH ends the connection as before.
+ */
+int write_channel(int fd, int channel);
+int write_open(int fd, int channel);
+
+/* Input for the command on a channel; an empty MSG_DATA means EOF. The
+ * caller keeps each one within the peer's frame limit. */
+int write_data(int fd, const char* buf, int len);
+
+/* Ask for the next command on a channel to run on a pty of the given size
+ * (MSG_PTY), or resize the pty of the one running (MSG_WINCH). */
+int write_winsize(int fd, int msg, int rows, int cols);
+
+/* Grant the writer on a channel bytes more credit. */
+int write_window(int fd, int channel, int bytes);
+
+/*
+ * Jobs. Each command the session accepts is a job, numbered from 1 in the
+ * order they are submitted. Its output is tagged with MSG_JOB inside its
+ * channel's tag, and it ends with a MSG_EXIT giving its exit status (128 +
+ * the signal, if killed), once its output is all sent. Jobs finish in
+ * whatever order they do.
+ */
+int write_job(int fd, int channel, int job);
+int write_exit(int fd, int channel, int job, int status);
+
+/*
+ * File transfer messages, sent on a channel in place of a command. Offsets
+ * and sizes are 64-bit, sent as two ints (high word first). File contents
+ * follow as MSG_DATA frames, ending with an empty one; see xfer.h.
+ */
+int write_uint64(int fd, unsigned long long i);
+int read_uint64(int fd, unsigned long long* i);
+int write_get(int fd, unsigned long long offset, const char* path);
+int write_put(int fd, unsigned long long offset, unsigned long long size,
+              const char* path);
+int write_progress(int fd, unsigned long long done, unsigned long long size);
+/* For MSG_DATA payloads, written after their header. */
+int write_raw(int fd, const void* buf, int len);
+
+/*
+ * Reading one short message with a str payload (such as a MSG_REPLY) from a
+ * non-blocking socket, a piece at a time. Returns 1 once the message is
+ * complete, with m->msg and m->str filled in; 0 if more input is needed; or
+ * -1 on EOF, error, or a payload longer than NB_MSG_MAX.
+ */
+#define NB_MSG_MAX 256
+struct nb_msg {
+  int len, msg;
+  char* str;
+  char buf[8 + NB_MSG_MAX + 1];
+};
+int read_nb_msg(int fd, struct nb_msg* m);
+
+/* Copy one message of type msg from one fd to another, checking the type
+ * (and that of any message nested in a MSG_CHANNEL) against the mask of
+ * allowed types. Returns the type relayed, or -1. */
+#define MSG_MASK(type) (1u << (type))
+int relay_msg(int from, int to, int msg, unsigned allowed);
+
+/*
+ * A message held in memory, so that it can be sent without blocking.
+ * msg_buf_read() reads and checks one message as relay_msg() does, and
+ * appends it; msg_buf_flush() sends as much as the socket will take,
+ * returning 1 once the buffer is empty, 0 if there's more to go, or -1.
+ * If memory runs out, the buffer fails: the put and every one after it
+ * return -1, and so does the next flush, so a caller may check only that.
+ */
+struct msg_buf {
+  char* buf;
+  int len, off, cap, failed;
+};
+int msg_buf_read(int from, int msg, unsigned allowed, struct msg_buf* b);
+int msg_buf_put(struct msg_buf* b, const void* buf, int len);
+int msg_buf_put_uint(struct msg_buf* b, int i);
+int msg_buf_flush(int to, struct msg_buf* b);
+
 #endif
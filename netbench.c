@@ -0,0 +1,397 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+/*
+ * Microbenchmark for the protocol codec in net.c. A child process writes a
+ * stream of messages and the parent decodes them, over a socketpair and over
+ * a pipe, for a few message mixes typical of a session. It needs neither root
+ * nor PAM, so it can be run anywhere to catch regressions in the framing.
+ *
+ * With -z LEVEL, the writer compresses its bulk frames as a session would
+ * once compression is agreed, and the ratio column shows what it saved.
+ *
+ * With -startup DAEMON, it instead times how long the daemon binary takes,
+ * started on demand as inetd would (-inetd), from exec to the username
+ * prompt: the latency a socket-activated connection sees. This needs root.
+ *
+ * With -check (make check), it instead tests the TCP transport over
+ * 127.0.0.1: tcp_listen() and tcp_connect() must give sockets with
+ * TCP_NODELAY set, and framed messages must come back intact from an echo.
+ *
+ * Usage: netbench [-n SCALE] [-z LEVEL] [mix...]
+ *        netbench -startup DAEMON [-n SCALE]
+ *        netbench -check
+ */
+
+#include "util.h"
+#include "log.h"
+#include "net.h"
+#include "compress.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+static char payload[64*1024];
+static int level = 0;
+
+/* Each mix is one round of messages, as they'd appear on the wire. */
+struct mix {
+  const char* name;
+  int rounds; /* per unit of SCALE */
+  void (*write_round)(int fd);
+  int msgs; /* per round */
+};
+
+static void fail() { fatal("netbench: write failed"); }
+
+static void login_round(int fd)
+{
+  if (write_text(fd, "Password: ") < 0 || write_prompt(fd, 0) < 0 ||
+      write_reply(fd, "correct horse battery staple") < 0 ||
+      write_finish(fd, 0) < 0)
+    fail();
+}
+/* Successive rounds take successive pieces of the payload, so that a
+ * compressor can't just match each against the last. */
+static const char* next_piece(int len)
+{
+  static int off = 0;
+  if (off + len > (int)sizeof(payload)) off = 0;
+  off += len;
+  return payload + off - len;
+}
+static void small_round(int fd)
+{
+  if (write_bulk(fd, 1, -1, MSG_TEXT, next_piece(64), 64) < 0) fail();
+}
+static void bulk_round(int fd)
+{
+  if (write_bulk(fd, 1, -1, MSG_TEXT, next_piece(4096), 4096) < 0) fail();
+}
+/* As large as fits in one frame, after any room for deflate. */
+static void large_round(int fd)
+{
+  int len = bulk_chunk(fd);
+  if (write_bulk(fd, -1, -1, MSG_TEXT, next_piece(len), len) < 0) fail();
+}
+
+static const struct mix mixes[] = {
+  { "login", 2000, login_round, 4 },
+  { "small", 10000, small_round, 1 },
+  { "bulk", 2000, bulk_round, 1 },
+  { "large", 100, large_round, 1 },
+};
+
+/* Something like command output, so that compression has work to do. */
+static void fill_payload()
+{
+  static const char* words[] = { "drwxr-xr-x", "-rw-r--r--", "root", "wheel",
+    "Jan", "netlogind", "session", "the", "of", "log", "conf" };
+  unsigned seed = 1, r;
+  int i = 0;
+  while (i < (int)sizeof(payload) - 1) {
+    seed = seed * 1103515245 + 12345;
+    r = seed >> 16;
+    if (r % 5 == 0)
+      i += snprintf(payload+i, sizeof(payload)-i, "%u\n", r % 100000);
+    else
+      i += snprintf(payload+i, sizeof(payload)-i, "%s ",
+                    words[r % (sizeof(words)/sizeof(words[0]))]);
+  }
+}
+
+/* Decode one message of any type; returns the payload bytes read, or -1. */
+static int read_any(int fd)
+{
+  int msg = read_msg_type(fd), len;
+  char* str;
+  switch (msg) {
+  case MSG_CHANNEL:
+    if (read_uint(fd) < 0) return -1;
+    return read_any(fd);
+  case MSG_FINISH:
+  case MSG_PROMPT:
+  case MSG_OPEN:
+    return read_uint(fd) < 0 ? -1 : 0;
+  case MSG_TEXT:
+  case MSG_REPLY:
+  case MSG_RESUME:
+  case MSG_TICKET:
+    if (!(str = read_strn(fd, &len))) return -1;
+    free(str);
+    return len;
+  case MSG_ZFRAME:
+    if (!(str = read_zframe(fd, &msg, &len))) return -1;
+    free(str);
+    return len;
+  default:
+    return -1;
+  }
+}
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void run(const struct mix* mix, int scale, int use_pipe)
+{
+  int fd[2], result[2], i, rounds = mix->rounds * scale;
+  long msgs = (long)rounds * mix->msgs;
+  double bytes = 0;
+  struct net_stats child;
+  struct compress_stats packed;
+
+  if (use_pipe ? pipe(fd) < 0 : socketpair(PF_UNIX, SOCK_STREAM, 0, fd) < 0)
+    perror_fatal("netbench:socketpair()");
+  if (pipe(result) < 0) perror_fatal("netbench:pipe()");
+  fflush(0);
+  int pid = fork();
+  if (pid < 0) perror_fatal("netbench:fork()");
+  if (pid == 0) {
+    (void)close(fd[0]);
+    (void)close(result[0]);
+    memset(&net_stats, 0, sizeof(net_stats));
+    if (level && compress_start(fd[1], level) < 0)
+      fatal("netbench: no compression");
+    for (i = 0; i < rounds; ++i) mix->write_round(fd[1]);
+    if (write(result[1], &net_stats, sizeof(net_stats)) < 0 ||
+        write(result[1], &compress_stats, sizeof(compress_stats)) < 0)
+      _exit(1);
+    _exit(0);
+  }
+  (void)close(fd[1]);
+  (void)close(result[1]);
+
+  memset(&net_stats, 0, sizeof(net_stats));
+  if (level && compress_start(fd[0], level) < 0)
+    fatal("netbench: no compression");
+  double start = now();
+  for (i = 0; i < msgs; ++i) {
+    int n = read_any(fd[0]);
+    if (n < 0) fatal("netbench: bad message %d in %s", i, mix->name);
+    bytes += n;
+  }
+  double elapsed = now() - start;
+  if (read(result[0], &child, sizeof(child)) != sizeof(child) ||
+      read(result[0], &packed, sizeof(packed)) != sizeof(packed))
+    fatal("netbench: writer failed");
+  compress_end(fd[0]);
+  while (waitpid(pid, 0, 0) < 0 && errno == EINTR)
+    ;
+  (void)close(fd[0]);
+  (void)close(result[0]);
+
+  if (elapsed <= 0) elapsed = 1e-6;
+  printf("%-6s %-10s %10.0f %10.1f %10.2f %10.2f %10.2f %10.2f\n",
+         mix->name, use_pipe ? "pipe" : "socketpair", msgs / elapsed,
+         bytes / elapsed / (1024*1024),
+         (double)(child.writes + child.reads) / msgs,
+         (double)(net_stats.reads + net_stats.writes) / msgs,
+         (double)(child.allocs + net_stats.allocs) / msgs,
+         packed.packed ? (double)packed.raw / packed.packed : 1.0);
+}
+
+/* One on-demand start of the daemon, on a socketpair, up to its first prompt.
+ * Returns the time it took. */
+static double startup_once(const char* daemon)
+{
+  int fd[2], pid, msg;
+  char* text;
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, fd) < 0)
+    perror_fatal("netbench:socketpair()");
+  fflush(0);
+  double start = now();
+  if ((pid = fork()) < 0) perror_fatal("netbench:fork()");
+  if (pid == 0) {
+    (void)close(fd[0]);
+    if (dup2(fd[1], 0) < 0 || dup2(fd[1], 1) < 0) _exit(127);
+    (void)close(fd[1]);
+    execl(daemon, daemon, "-inetd", "-logfile", "/dev/null", (char*)0);
+    _exit(127);
+  }
+  (void)close(fd[1]);
+  if (read_msg_type(fd[0]) != MSG_MAXFRAME || read_uint(fd[0]) < 0 ||
+      read_msg_type(fd[0]) != MSG_TEXT || !(text = read_str(fd[0])))
+    fatal("netbench: %s sent no greeting", daemon);
+  free(text);
+  if ((msg = read_msg_type(fd[0])) != MSG_PROMPT || read_uint(fd[0]) < 0)
+    fatal("netbench: bad message %d from %s", msg, daemon);
+  double elapsed = now() - start;
+  (void)close(fd[0]);
+  while (waitpid(pid, 0, 0) < 0 && errno == EINTR)
+    ;
+  return elapsed;
+}
+
+static void startup(const char* daemon, int scale)
+{
+  int i, runs = 20 * scale;
+  double total = 0, best = 0;
+  for (i = 0; i < runs; ++i) {
+    double t = startup_once(daemon);
+    total += t;
+    if (!i || t < best) best = t;
+  }
+  printf("%-10s %10s %10s\n", "startup", "mean ms", "best ms");
+  printf("%-10s %10.2f %10.2f\n", "inetd", total / runs * 1000, best * 1000);
+}
+
+static void check_nodelay(int fd, const char* which)
+{
+  int on = 0;
+  socklen_t len = sizeof(on);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, &len) < 0)
+    perror_fatal("netbench:getsockopt(TCP_NODELAY)");
+  if (!on) fatal("netbench: no TCP_NODELAY on the %s socket", which);
+}
+
+/* The server end: send back each message as it came, until a finish. */
+static void check_echo(int listen_fd)
+{
+  int fd = accept(listen_fd, 0, 0), len;
+  char* str;
+  if (fd < 0) perror_fatal("netbench:accept()");
+  /* As the daemon does for each connection it accepts. */
+  tcp_setsockopts(fd);
+  check_nodelay(fd, "accepted");
+  for (;;) {
+    switch (read_msg_type(fd)) {
+    case MSG_TEXT:
+      if (!(str = read_strn(fd, &len)) || write_textn(fd, str, len) < 0)
+        _exit(1);
+      free(str);
+      break;
+    case MSG_REPLY:
+      if (!(str = read_str(fd)) || write_reply(fd, str) < 0) _exit(1);
+      free(str);
+      break;
+    case MSG_FINISH:
+      if ((len = read_uint(fd)) < 0 || write_finish(fd, len) < 0) _exit(1);
+      _exit(0);
+    default:
+      _exit(1);
+    }
+  }
+}
+
+static void check_text(int fd, const char* buf, int len)
+{
+  int got = 0, n;
+  char* str = 0;
+  if (write_textn(fd, buf, len) < 0) fatal("netbench: write failed");
+  while (got < len) {
+    if (read_msg_type(fd) != MSG_TEXT || !(str = read_strn(fd, &n)) ||
+        n > len - got)
+      fatal("netbench: bad echo of %d bytes", len);
+    if (memcmp(str, buf + got, n))
+      fatal("netbench: %d byte echo garbled", len);
+    got += n;
+    free(str);
+  }
+}
+
+static int check()
+{
+  static const int sizes[] = { 1, 64, 4096, FRAME_DEFAULT };
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  char addr[32], *str = 0;
+  int listen_fd, fd, pid, status, n;
+  unsigned k;
+
+  if ((listen_fd = tcp_listen("127.0.0.1:0")) < 0 ||
+      getsockname(listen_fd, (struct sockaddr*)&sin, &len) < 0)
+    fatal("netbench: can't listen on 127.0.0.1");
+  snprintf(addr, sizeof(addr), "127.0.0.1:%d", ntohs(sin.sin_port));
+  fflush(0);
+  if ((pid = fork()) < 0) perror_fatal("netbench:fork()");
+  if (pid == 0) check_echo(listen_fd);
+  (void)close(listen_fd);
+
+  if ((fd = tcp_connect(addr)) < 0)
+    fatal("netbench: can't connect to %s", addr);
+  check_nodelay(fd, "connecting");
+  for (k = 0; k < sizeof(sizes)/sizeof(sizes[0]); ++k)
+    check_text(fd, next_piece(sizes[k]), sizes[k]);
+  if (write_reply(fd, "correct horse battery staple") < 0 ||
+      !(str = read_reply(fd)) ||
+      strcmp(str, "correct horse battery staple"))
+    fatal("netbench: bad echo of a reply");
+  free(str);
+  if (write_finish(fd, 42) < 0 || read_msg_type(fd) != MSG_FINISH ||
+      (n = read_uint(fd)) != 42)
+    fatal("netbench: bad echo of a finish");
+  (void)close(fd);
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    fatal("netbench: echo server failed");
+  printf("check: tcp %s ok\n", addr);
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  int i, j, scale = 1, any = 0;
+  const char* daemon = 0;
+  unsigned k;
+  signal(SIGPIPE, SIG_IGN);
+  fill_payload();
+  /* As if both ends had announced the default limit. */
+  frame_max.send = frame_max.recv = FRAME_DEFAULT;
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-n") && i+1 < argc) scale = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-z") && i+1 < argc) level = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-startup") && i+1 < argc) daemon = argv[++i];
+    else if (!strcmp(argv[i], "-check")) return check();
+    else any = 1;
+  }
+  if (scale < 1) scale = 1;
+  if (daemon) {
+    startup(daemon, scale);
+    return 0;
+  }
+
+  printf("%-6s %-10s %10s %10s %10s %10s %10s %10s\n", "mix", "transport",
+         "msgs/s", "MiB/s", "wsys/msg", "rsys/msg", "alloc/msg", "ratio");
+  for (k = 0; k < sizeof(mixes)/sizeof(mixes[0]); ++k) {
+    int wanted = !any;
+    for (i = 1; i < argc; ++i) {
+      if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "-z")) { ++i; continue; }
+      if (!strcmp(argv[i], mixes[k].name)) wanted = 1;
+    }
+    if (!wanted) continue;
+    for (j = 0; j < 2; ++j) run(&mixes[k], scale, j);
+  }
+  return 0;
+}
@@ -19,14 +19,24 @@
 
 #include "config.h"
 #include "util.h"
+#include "log.h"
 #include "net.h"
 #include "session.h"
+#include "xfer.h"
+#include "compress.h"
+#include "record.h"
+#include "cgroup.h"
+#include "acct.h"
 #include "os.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include <stdio.h>
@@ -37,18 +47,400 @@
 #include <errno.h>
 #include <assert.h>
 #include <termios.h>
+#include <time.h>
 
-#define SOCK_NAME "/tmp/netlogind.sock"
+#define MAX_LISTENERS 8
+#define MAX_PENDING 64
+#define PENDING_TIMEOUT 60
+#define MAX_ACTIVE 256
+#define NO_UID ((uid_t)-1)
 #if HAVE_CHROOT
 #define CHROOT_DIR "/var/empty"
 #endif
 
 
 static int client_fd = -1;
+static const char* client_addr = 0;
+static int client_channels = 1;
+static const char* client_ticket = 0;
+/* With -record, the file to keep a transcript of the connection in. */
+static const char* client_record = 0;
+
+/* With -c, the one command to run, which is fed our stdin. */
+static const char* client_command = 0;
+static int stdin_channel = -1, stdin_eof = 0, stdin_prompt = -1;
+static int stdin_credit = 0;
+/* The exit status of the -c command, for our own. */
+static int command_status = 0;
+static struct msg_buf client_out;
+
+/* Output we've taken from each channel, but not yet granted back. */
+static int* out_unacked = 0;
+
+/* With -pty as well, the command runs on a pty, and our terminal is put in
+ * raw mode to pass everything typed through to it. */
+static int client_pty = 0, tty_raw = 0;
+
+/* With -compress, ask for compression at compress_level. */
+static int client_compress = 0;
+static volatile sig_atomic_t winch = 0;
+static struct termios tty_saved;
+
+/* A file transfer to run, with -get or -put, in place of reading commands.
+ * It takes over the first channel to prompt, and goes through the states
+ * below in turn. */
+enum { XFER_NONE, XFER_WANTED, XFER_ASKED, XFER_SENT };
+static int xfer_state = XFER_NONE, xfer_msg = 0, xfer_status = 0;
+static int xfer_channel = -1, xfer_fd = -1;
+static const char *xfer_remote = 0, *xfer_local = 0;
+static long long xfer_off = 0, xfer_size = 0;
+
+/* With -timing, the client notes when each message arrives, and prints a
+ * breakdown to stderr as it exits. Server time runs from each reply we send
+ * to the next frame back; think time from a prompt to the user's answer.
+ * All times are in milliseconds from just before connecting. */
+#define TIMING_EVENTS_MAX 100000
+static int client_timing = 0;
+static struct timing_event {
+  double at, server, think; /* -1 where it doesn't apply */
+  int msg, channel;
+} *timing_events = 0;
+static int n_timing_events = 0, timing_events_size = 0;
+static double timing_start = 0, timing_connect = 0;
+static double timing_prompted = -1, timing_replied = -1;
+static double timing_server = 0, timing_think = 0;
+
+static double timing_now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return (tv.tv_sec * 1e3 + tv.tv_usec / 1e3) - timing_start;
+}
+
+static void timing_add(double at, int msg, int channel, double server,
+                       double think)
+{
+  if (n_timing_events == timing_events_size) {
+    int size = timing_events_size ? 2*timing_events_size : 64;
+    struct timing_event* events;
+    if (size > TIMING_EVENTS_MAX) return;
+    if (!(events = realloc(timing_events, size * sizeof(*events)))) return;
+    timing_events = events;
+    timing_events_size = size;
+  }
+  timing_events[n_timing_events].at = at;
+  timing_events[n_timing_events].server = server;
+  timing_events[n_timing_events].think = think;
+  timing_events[n_timing_events].msg = msg;
+  timing_events[n_timing_events++].channel = channel;
+}
+
+/* A message has arrived. Bulk frames are only listed when they're the
+ * server's answer to a reply. */
+static void timing_received(int msg, int channel)
+{
+  double now = timing_now(), server = -1;
+  if (timing_replied >= 0) {
+    server = now - timing_replied;
+    timing_server += server;
+    timing_replied = -1;
+  }
+  if (msg == MSG_PROMPT) timing_prompted = now;
+  if (server >= 0 || msg == MSG_TEXT || msg == MSG_PROMPT ||
+      msg == MSG_FINISH || msg == MSG_EXIT)
+    timing_add(now, msg, channel, server, -1);
+}
+
+/* We've answered a prompt, typed by the user if by_hand. */
+static void timing_replied_to(int channel, int by_hand)
+{
+  double now = timing_now(), think = -1;
+  if (by_hand && timing_prompted >= 0) {
+    think = now - timing_prompted;
+    timing_think += think;
+  }
+  timing_prompted = -1;
+  timing_replied = now;
+  timing_add(now, MSG_REPLY, channel, -1, think);
+}
+
+static void timing_report()
+{
+  double total = timing_now(), prev = 0;
+  int i;
+  fprintf(stderr, "%10s %9s %9s %9s  %s\n", "at ms", "+ms", "server", "think",
+          "event");
+  fprintf(stderr, "%10.3f %9.3f %9s %9s  connect\n", timing_connect,
+          timing_connect, "", "");
+  prev = timing_connect;
+  for (i = 0; i < n_timing_events; ++i) {
+    struct timing_event* e = &timing_events[i];
+    char server[16] = "", think[16] = "";
+    if (e->server >= 0) snprintf(server, sizeof(server), "%9.3f", e->server);
+    if (e->think >= 0) snprintf(think, sizeof(think), "%9.3f", e->think);
+    fprintf(stderr, "%10.3f %9.3f %9s %9s  %s", e->at, e->at - prev, server,
+            think, msg_name(e->msg));
+    if (e->channel >= 0) fprintf(stderr, " channel=%d", e->channel);
+    fputc('\n', stderr);
+    prev = e->at;
+  }
+  if (n_timing_events == TIMING_EVENTS_MAX)
+    fprintf(stderr, "(only the first %d events are listed)\n",
+            TIMING_EVENTS_MAX);
+  fprintf(stderr, "total %.3f ms: connect %.3f, server %.3f, think %.3f, "
+          "other %.3f\n", total, timing_connect, timing_server, timing_think,
+          total - timing_connect - timing_server - timing_think);
+}
 static void client_fd_cleanup()
 {
   if (client_fd < 0) return;
-  if (close(client_fd) < 0) perror("close(client_fd)");
+  if (close(client_fd) < 0) log_perror("close(client_fd)");
+}
+
+/* Connections the listener has accepted and prompted for a username, but
+ * which haven't answered yet. Nothing is forked for them until they do, so
+ * port scanners and health checks cost us only a table entry. */
+static struct pending {
+  int fd;
+  unsigned conn_id;
+  uid_t uid;
+  time_t deadline;
+  struct nb_msg m;
+} pending[MAX_PENDING];
+static int n_pending = 0;
+
+/* Connections that have been forked off. The listener holds the read end of a
+ * pipe whose write end lives on in the connection's processes (but not in the
+ * user's commands), so it sees a hangup once the connection is over. */
+static struct active {
+  int fd;
+  uid_t uid;
+} active[MAX_ACTIVE];
+static int n_active = 0;
+
+/* Admission limits, counting both pending and active connections; 0 means
+ * no limit. Peers whose uid can't be known (TCP) aren't one user, so they
+ * count against max_tcp rather than max_per_uid. */
+static int max_conn = 128, max_per_uid = 16, max_tcp = 0;
+
+static int admit(uid_t uid)
+{
+  int i, n = 0, limit = uid == NO_UID ? max_tcp : max_per_uid;
+  if (n_pending == MAX_PENDING || n_pending + n_active >= max_conn)
+    return 0;
+  if (limit <= 0) return 1;
+  for (i = 0; i < n_pending; ++i) n += pending[i].uid == uid;
+  for (i = 0; i < n_active; ++i) n += active[i].uid == uid;
+  return n < limit;
+}
+
+static void pending_accept(int listen_fd, int tcp, unsigned conn_id)
+{
+  uid_t uid;
+  int fd = accept(listen_fd, 0, 0);
+  if (fd < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+      log_perror("accept()");
+    return;
+  }
+  if (tcp) tcp_setsockopts(fd);
+  if (peer_uid(fd, &uid) < 0) uid = NO_UID;
+  /* Turn away excess connections straight away, rather than leaving them to
+   * time out in the backlog. */
+  if (!admit(uid)) {
+    logkv(LOG_WARNING, "event=busy uid=%ld pending=%d active=%d",
+          uid == NO_UID ? -1L : (long)uid, n_pending, n_active);
+    (void)write_text(fd, "Server busy, try again later\n");
+    (void)write_finish(fd, 1);
+    (void)close(fd);
+    return;
+  }
+  /* The greeting is tiny, so it can't block on a fresh socket. */
+  if (write_maxframe(fd, frame_max.recv) < 0 ||
+      write_text(fd, "Username: ") < 0 || write_prompt(fd, 1) < 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+    (void)close(fd);
+    return;
+  }
+  memset(&pending[n_pending], 0, sizeof(pending[n_pending]));
+  pending[n_pending].fd = fd;
+  pending[n_pending].conn_id = conn_id;
+  pending[n_pending].uid = uid;
+  pending[n_pending].deadline = time(0) + PENDING_TIMEOUT;
+  ++n_pending;
+}
+
+static void pending_drop(int i)
+{
+  (void)close(pending[i].fd);
+  buffer_scrub(&pending[i].m, sizeof(pending[i].m));
+  pending[i] = pending[--n_pending];
+}
+
+/* Hot restart. On SIGUSR2, the listener stops accepting, lets the pending
+ * connections answer or time out (new ones wait in the listen backlog), then
+ * execs its binary afresh with the same arguments, handing over the listening
+ * sockets, the active connections and the log and accounting writers in
+ * RESTART_ENV:
+ *   "conn=N log=FD acct=FD listen=FD,FD... active=FD:UID,FD:UID..."
+ * The new image takes them up in place of starting from scratch, so nothing
+ * is refused. Connections already forked are separate processes, which carry
+ * on under the old image until they finish. */
+#define RESTART_ENV "NETLOGIND_RESTART"
+static volatile sig_atomic_t restart_wanted = 0;
+static int restart_pipe[2] = { -1, -1 }; /* wakes the listener's poll() */
+static char* restart_path = 0;
+static char** restart_argv = 0;
+static void restart_handler(int sig)
+{
+  int saved_errno = errno;
+  ssize_t rv = write(restart_pipe[1], "", 1);
+  (void)rv;
+  restart_wanted = 1;
+  errno = saved_errno;
+}
+
+/* Append to the handoff; returns -1, and leaves *len past the end, once it
+ * doesn't fit. */
+static int restart_append(char* env, int size, int* len, const char* fmt, ...)
+{
+  va_list ap;
+  int n;
+  if (*len >= size) return -1;
+  va_start(ap, fmt);
+  n = vsnprintf(env + *len, size - *len, fmt, ap);
+  va_end(ap);
+  if (n < 0 || n >= size - *len) {
+    *len = size;
+    return -1;
+  }
+  *len += n;
+  return 0;
+}
+
+static void daemon_restart(const int* listen_fds, int n_listeners,
+                           unsigned next_conn)
+{
+  /* Numbers take up to 11 characters: ",FD" for each listener and
+   * ",FD:UID" for each active connection, after the rest. */
+  char env[80 + 12*MAX_LISTENERS + 24*MAX_ACTIVE];
+  int i, len = 0, ok;
+  restart_wanted = 0;
+  if (!restart_path) {
+    logmsg(LOG_ERR, "Can't restart: no path to our binary");
+    return;
+  }
+  ok = !restart_append(env, sizeof(env), &len,
+                       "conn=%u log=%d acct=%d listen=", next_conn,
+                       log_handoff(), acct_handoff());
+  for (i = 0; ok && i < n_listeners; ++i)
+    ok = !restart_append(env, sizeof(env), &len, "%s%d", i ? "," : "",
+                         listen_fds[i]);
+  ok = ok && !restart_append(env, sizeof(env), &len, " active=");
+  for (i = 0; ok && i < n_active; ++i)
+    ok = !restart_append(env, sizeof(env), &len, "%s%d:%ld", i ? "," : "",
+                         active[i].fd, active[i].uid == NO_UID ?
+                         -1L : (long)active[i].uid);
+  if (!ok) {
+    logmsg(LOG_ERR, "Can't restart: too much to hand over");
+  } else {
+    logkv(LOG_INFO, "event=restart path=%s active=%d", restart_path,
+          n_active);
+    if (setenv(RESTART_ENV, env, 1) == 0) {
+      /* Absolute, so the new image can find itself in turn. */
+      restart_argv[0] = restart_path;
+      execvp(restart_path, restart_argv);
+      log_perror("execvp()");
+    }
+  }
+  /* Carry on as we were. */
+  (void)unsetenv(RESTART_ENV);
+  log_adopt(log_handoff());
+  acct_adopt(acct_handoff());
+}
+
+/* In the new image: take up what the old one handed over. Returns the number
+ * of listeners, or -1 if the handoff is garbled. */
+static int daemon_adopt(const char* env, int* listen_fds, unsigned* next_conn)
+{
+  char* str = strdup(env), *tok, *save = 0;
+  int n_listeners = -1;
+  if (!str) fatal("malloc()");
+  for (tok = strtok_r(str, " ", &save); tok; tok = strtok_r(0, " ", &save)) {
+    char* p = strchr(tok, '=');
+    if (!p) goto garbled;
+    *p++ = '\0';
+    if (!strcmp(tok, "conn")) {
+      *next_conn = strtoul(p, 0, 10);
+    } else if (!strcmp(tok, "log")) {
+      int fd = atoi(p);
+      if (fd >= 0 && fcntl(fd, F_GETFD) < 0) goto garbled;
+      log_adopt(fd);
+    } else if (!strcmp(tok, "acct")) {
+      int fd = atoi(p);
+      if (fd >= 0 && fcntl(fd, F_GETFD) < 0) goto garbled;
+      acct_adopt(fd);
+    } else if (!strcmp(tok, "listen")) {
+      for (n_listeners = 0; *p && n_listeners < MAX_LISTENERS; ) {
+        listen_fds[n_listeners] = (int)strtol(p, &p, 10);
+        if (fcntl(listen_fds[n_listeners++], F_GETFD) < 0) goto garbled;
+        if (*p == ',') ++p;
+      }
+    } else if (!strcmp(tok, "active")) {
+      while (*p && n_active < MAX_ACTIVE) {
+        long uid;
+        active[n_active].fd = (int)strtol(p, &p, 10);
+        if (*p++ != ':' || fcntl(active[n_active].fd, F_GETFD) < 0)
+          goto garbled;
+        uid = strtol(p, &p, 10);
+        active[n_active++].uid = uid < 0 ? NO_UID : (uid_t)uid;
+        if (*p == ',') ++p;
+      }
+    }
+  }
+  free(str);
+  return n_listeners;
+
+ garbled:
+  free(str);
+  return -1;
+}
+
+/* Socket activation: listening sockets passed in by a launcher, either as
+ * systemd does it (LISTEN_FDS of them from fd 3, meant for LISTEN_PID) or as
+ * inetd does in "wait" mode (one, on our stdio). Returns how many we took. */
+static void stdio_to_null();
+static int launcher_adopt(int* listen_fds)
+{
+  const char* pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS");
+  int i, n = 0;
+  if (pid && fds && strtol(pid, 0, 10) == (long)getpid()) {
+    n = atoi(fds);
+    (void)unsetenv("LISTEN_PID");
+    (void)unsetenv("LISTEN_FDS");
+    (void)unsetenv("LISTEN_FDNAMES");
+    if (n < 1 || n > MAX_LISTENERS) fatal("Bad LISTEN_FDS");
+    for (i = 0; i < n; ++i) {
+      listen_fds[i] = 3 + i;
+      if (!is_listening(listen_fds[i]))
+        fatal("LISTEN_FDS: fd %d is not a listening socket", listen_fds[i]);
+    }
+  } else if (is_listening(0)) {
+    if ((listen_fds[n++] = dup(0)) < 0) perror_fatal("dup()");
+    stdio_to_null();
+  }
+  return n;
+}
+
+/* Launched on a socket, keep it off stdio, where stray output would land in
+ * the protocol. */
+static void stdio_to_null()
+{
+  int i, fd = open("/dev/null", O_RDWR);
+  if (fd < 0) perror_fatal("open(/dev/null)");
+  for (i = 0; i < 3; ++i)
+    if (fd != i && dup2(fd, i) < 0) perror_fatal("dup2()");
+  if (fd > 2) (void)close(fd);
 }
 
 static int client_main();
@@ -56,7 +448,7 @@ static void client_cleanup()
 {
   client_fd_cleanup();
 }
-static void client_fatal(const char* fmt, ...)
+static NORETURN void client_fatal(const char* fmt, ...)
 {
   client_cleanup();
   va_list ap;
@@ -72,7 +464,7 @@ static void daemon_cleanup()
   session_cleanup();
   free(daemon_username);
 }
-static void daemon_fatal(const char* fmt, ...)
+static NORETURN void daemon_fatal(const char* fmt, ...)
 {
   daemon_cleanup();
   va_list ap;
@@ -95,65 +487,65 @@ static void auth_timeout(int sig)
  *
  * Usage: netlogind            - spawn a daemon that listens
  *        netlogind -client    - connect
+ *
+ * Daemon options: -logfile FILE  log to FILE instead of syslog
+ *                 -tcp ADDR      also listen on TCP [host:]port (repeatable)
+ *                 -resume SECS   let finished sessions be resumed for SECS
+ *                 -peerauth      skip the password for a local client already
+ *                                running as the user it logs in as
+ *                 -maxconn N     admit at most N connections at once
+ *                 -maxperuid N   ... and at most N from any one user
+ *                 -maxtcp N      ... and at most N over TCP (by default,
+ *                                only -maxconn limits them); for each of
+ *                                these, 0 means no limit
+ *                 -maxjobs N     run at most N of a session's jobs at once
+ *                                (by default, one per CPU it may use)
+ *                 -cgroup DIR    run each session's commands in a cgroup v2
+ *                                leaf under DIR (Linux)
+ *                 -cpuweight N   ... with cpu.weight N
+ *                 -memorymax BYTES  ... and memory.max BYTES
+ *                 -placement cpu[:N]|node|FILE  pin sessions round robin
+ *                                to groups of N CPUs (4 by default) or a
+ *                                NUMA node, or as FILE maps users and
+ *                                @groups to CPU lists (Linux)
+ *                 -inetd         serve the one connection on stdin, as
+ *                                inetd's "nowait" mode or systemd's
+ *                                Accept=yes start us
+ *                 -idle SECS     exit after SECS with no connections, for
+ *                                a launcher to start us again on demand
+ *                 (SIGUSR2 restarts the daemon from its binary, without
+ *                 dropping the listening sockets. Listening sockets passed
+ *                 by systemd in LISTEN_FDS, or by inetd's "wait" mode on
+ *                 stdin, are served in place of our own.)
+ * Client options: -connect ADDR  connect over TCP instead of the UNIX socket
+ *                 -channels N    run commands on N channels at once
+ *                 -ticket FILE   keep a resumption ticket in FILE
+ *                 -c COMMAND     run COMMAND with this client's stdin
+ *                 -pty           ... on a pty, with the terminal in raw mode
+ *                 -get REMOTE LOCAL  download a file (resuming a partial one)
+ *                 -put LOCAL REMOTE  upload a file (resuming a partial one)
+ *                 -timing        print when each message arrived, and how
+ *                                much of the wait was server or user, on exit
+ *                 -record FILE   keep a transcript of the connection in FILE,
+ *                                passwords left out, for netreplay
+ * Socket options: -backlog N, -keepalive, -sndbuf BYTES, -rcvbuf BYTES,
+ *                 -maxframe BYTES (largest message payload to accept),
+ *                 -window BYTES (most to have queued for any one stream),
+ *                 -compress LEVEL (deflate bulk frames; 0 refuses it)
  */
 
-int main(int argc, char** argv) {
-  int rv, client = 0, i;
-  for (i = 0; i < argc; ++i) {
-    if (!strcmp(argv[i], "-client")) client = 1;
-    if (!strcmp(argv[i], "-debug")) debug_ = 1;
-    if (!strcmp(argv[i], "-noauth")) perform_authentication = 0;
-  }
-
-  signal(SIGPIPE, SIG_IGN);
-
-  if (client) return client_main();
-
-  if (getuid() != 0 || geteuid() != 0)
-    fatal("Daemon must run as root");
-
-  if (is_un_connectable(SOCK_NAME))
-    fatal("Daemon already running");
-
-  if (!debug_) daemonize();
-
-  (void)unlink(SOCK_NAME);
-  int listen_fd = un_listen(SOCK_NAME);
-  if (listen_fd < 0) fatal("Could not listen");
-
-  while (1) {
-    client_fd = accept(listen_fd, 0, 0);
-    if (client_fd < 0 && errno == EINTR) continue;
-    if (client_fd < 0) perror_fatal("accept()");
-    if (debug_) break;
-    fflush(0);
-    rv = fork();
-    if (rv < 0) perror_fatal("fork()");
-    if (rv == 0) break;
-    /* parent: reap child and accept again */
-    int child = rv;
-    while (1) {
-      if (waitpid(child, 0, 0) < 0) {
-        if (errno != EINTR) perror_fatal("waitpid()");
-      } else break;
-    }
-    sleep(1); /* prevent fork-bomb */
-  }
-  if (!debug_) {
-    /* This setsid() is important: the child is not in the same session as the
-     * listener parent because we do actually call functions that affect the
-     * whole session before forking again. */
-    if (setsid() < 0) perror_fatal("setsid(listener_child)");
-    os_daemon_post_fork();
-    rv = fork();
-    if (rv < 0) perror_fatal("fork()");
-    if (rv > 0) _exit(0);
-  }
-
-  /* child: a process spawned for each client connection */
+/* A process spawned for each client connection, which has client_fd and the
+ * login reply it was admitted on. */
+static int connection_main(unsigned conn_id)
+{
+  int rv;
+  log_set_conn(conn_id);
+  os_session_seq = conn_id;
+  log_set_phase("auth");
   setproctitle("[authenticating]");
-  debug("Client connected");
-  if (close(listen_fd) < 0) perror("close(listen_fd)");
+  logkv(LOG_INFO, "event=connect");
+
+  session_peer_known = peer_uid(client_fd, &session_peer_uid) == 0;
 
   fflush(0);
   {
@@ -173,6 +565,9 @@ int main(int argc, char** argv) {
   }
   if (rv == 0) return session_main();
   session_pid = rv;
+  buffer_scrub(login_reply, strlen(login_reply));
+  free(login_reply);
+  login_reply = 0;
 
   /* If we need root or user privileges later, we could use privilege separation
    * here, and drop root after authentication. */
@@ -181,17 +576,17 @@ int main(int argc, char** argv) {
   char pw_buf[1024];
   rv = getpwnam_r("nobody", &pw, pw_buf, sizeof(pw_buf), &pwp);
   if (!pwp) {
-    if (rv) { errno = rv; perror("getpwnam()"); }
+    if (rv) { errno = rv; log_perror("getpwnam()"); }
     debug("Warning: not dropping privileges");
   } else {
 #if HAVE_CHROOT
-    if (chroot(CHROOT_DIR) < 0) perror("chroot("CHROOT_DIR")");
+    if (chroot(CHROOT_DIR) < 0) log_perror("chroot("CHROOT_DIR")");
 #endif
     setpasswd(pwp);
   }
 
-  /* Set the auth timeout alarm; this and the sleep(1) above guarantee that
-   * max load on the system from unauthenticated users is 60 processes. */
+  /* Set the auth timeout alarm; this and the listener's admission limits
+   * bound the load unauthenticated users can put on the system. */
   signal(SIGALRM, auth_timeout);
   alarm(60);
 
@@ -232,12 +627,9 @@ int main(int argc, char** argv) {
         if (echo < 0) daemon_fatal("Unexpected disconnection");
         if (write_prompt(client_fd, echo) < 0)
           daemon_fatal("Unexpected disconnection");
-        char* reply = read_reply(client_fd);
-        if (!reply) daemon_fatal("Unexpected disconnection");
-        rv = write_reply(session_fd, reply);
-        buffer_scrub(reply, strlen(reply));
-        free(reply);
-        if (rv < 0) daemon_fatal("Unexpected disconnection");
+        if (relay_msg(client_fd, session_fd, read_msg_type(client_fd),
+                      MSG_MASK(MSG_REPLY)) < 0)
+          daemon_fatal("Unexpected disconnection");
       }
       break;
     default:
@@ -248,57 +640,877 @@ int main(int argc, char** argv) {
       if (authenticated) break;
       authenticated = 1;
 
-      /* At this point, if we were doing the privsep design, we'd rejoin the
-       * [net] process, perform whatever action we were interested in staying
-       * root for, then drop our privileges. */
+      /* From here the session serves the client itself: rather than copy
+       * every frame across, we hand it the connection and go, leaving the
+       * session to init to reap. */
       alarm(0);
-      setproctitle("%s [net]", daemon_username);
       debug("Session process running for \"%s\"", daemon_username);
+      if (send_fd(session_fd, client_fd) < 0)
+        daemon_fatal("Could not hand over the connection");
+      client_fd_cleanup();
+      (void)close(session_fd);
+      free(daemon_username);
+      return 0;
     }
   }
 
-  (void)write_finish(client_fd, 0);
   daemon_cleanup();
 
   return 0;
 }
 
+/* The zygote: forked from the listener as soon as it's set up, before it has
+ * accepted anything, it forks each connection's processes in its stead. Those
+ * then start from a small, clean image that has never held another client's
+ * sockets or replies, however long the listener has been running, and the
+ * listener needn't stop to fork. It's asked over zygote_fd with the client's
+ * descriptor and the connection's end of its live pipe, then:
+ *   int conn_id, int login_msg, str login_reply
+ * and exits when the listener closes its end, whether on exit or by exec.
+ * The listener took the reply with read_nb_msg(), so it's at most NB_MSG_MAX,
+ * well inside the frame_max.recv that read_str() holds it to here. It's
+ * written raw only because write_str() checks frame_max.send instead. */
+static int zygote_fd = -1;
+
+static void zygote_main(int sock)
+{
+  int rv, live, conn, msg;
+  char* reply;
+  setproctitle("[zygote]");
+  signal(SIGUSR2, SIG_DFL);
+  while (1) {
+    if ((client_fd = recv_fd(sock)) < 0) _exit(0);
+    if ((live = recv_fd(sock)) < 0 || (conn = read_uint(sock)) < 0 ||
+        (msg = read_uint(sock)) < 0 || !(reply = read_str(sock)))
+      _exit(1);
+    (void)fcntl(live, F_SETFD, FD_CLOEXEC);
+    fflush(0);
+    rv = fork();
+    if (rv == 0) {
+      (void)close(sock);
+      login_msg = msg;
+      login_reply = reply;
+      /* This setsid() is important: the child is not in the same session as
+       * the listener because we do actually call functions that affect the
+       * whole session before forking again. */
+      if (setsid() < 0) perror_fatal("setsid(listener_child)");
+      os_daemon_post_fork();
+      rv = fork();
+      if (rv < 0) perror_fatal("fork()");
+      if (rv > 0) _exit(0);
+      exit(connection_main(conn));
+    }
+    if (rv < 0) log_perror("fork()");
+    (void)close(client_fd);
+    client_fd = -1;
+    (void)close(live);
+    buffer_scrub(reply, strlen(reply));
+    free(reply);
+    while (rv > 0 && waitpid(rv, 0, 0) < 0 && errno == EINTR)
+      ;
+  }
+}
+
+static void zygote_start(const int* listen_fds, int n_listeners)
+{
+  int fd[2], i, rv;
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+    log_perror("socketpair()");
+    return;
+  }
+  (void)fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+  fflush(0);
+  rv = fork();
+  if (rv < 0) {
+    log_perror("fork()");
+    (void)close(fd[0]);
+    (void)close(fd[1]);
+    return;
+  }
+  if (rv == 0) {
+    /* Detached, so that a listener restarted from its binary, which knows
+     * nothing of us, isn't left with us to reap. */
+    rv = fork();
+    if (rv != 0) _exit(rv < 0);
+    (void)close(fd[0]);
+    for (i = 0; i < n_listeners; ++i) (void)close(listen_fds[i]);
+    for (i = 0; i < n_pending; ++i) (void)close(pending[i].fd);
+    for (i = 0; i < n_active; ++i) (void)close(active[i].fd);
+    (void)close(restart_pipe[0]);
+    (void)close(restart_pipe[1]);
+    zygote_main(fd[1]);
+  }
+  (void)close(fd[1]);
+  while (waitpid(rv, 0, 0) < 0 && errno == EINTR)
+    ;
+  zygote_fd = fd[0];
+}
+
+/* Hand the connection in client_fd to the zygote, starting another if the
+ * one we had has gone. */
+static int zygote_spawn(unsigned conn_id, int live, const int* listen_fds,
+                        int n_listeners)
+{
+  int tries;
+  for (tries = 0; tries < 2; ++tries) {
+    if (zygote_fd < 0) zygote_start(listen_fds, n_listeners);
+    if (zygote_fd < 0) return -1;
+    if (send_fd(zygote_fd, client_fd) == 0 && send_fd(zygote_fd, live) == 0 &&
+        write_uint(zygote_fd, (int)conn_id) >= 0 &&
+        write_uint(zygote_fd, login_msg) >= 0 &&
+        write_uint(zygote_fd, (int)strlen(login_reply)) >= 0 &&
+        write_raw(zygote_fd, login_reply, (int)strlen(login_reply)) >= 0)
+      return 0;
+    logmsg(LOG_ERR, "Lost the zygote; starting another");
+    (void)close(zygote_fd);
+    zygote_fd = -1;
+  }
+  return -1;
+}
+
+int main(int argc, char** argv) {
+  int rv, client = 0, i, inetd = 0, idle_exit = 0;
+  const char* logfile = 0;
+  const char* tcp_addrs[MAX_LISTENERS];
+  int n_tcp = 0;
+  unsigned conn_id = 0, next_conn = 0;
+  /* To exec for a restart; we'll have changed directory by then. */
+  restart_path = strchr(argv[0], '/') ? realpath(argv[0], 0) : argv[0];
+  restart_argv = argv;
+  for (i = 0; i < argc; ++i) {
+    if (!strcmp(argv[i], "-client")) client = 1;
+    if (!strcmp(argv[i], "-debug")) debug_ = 1;
+    if (!strcmp(argv[i], "-noauth")) perform_authentication = 0;
+    if (!strcmp(argv[i], "-peerauth")) peer_authentication = 1;
+    if (!strcmp(argv[i], "-logfile") && i+1 < argc) logfile = argv[++i];
+    if (!strcmp(argv[i], "-tcp") && i+1 < argc) {
+      if (n_tcp == MAX_LISTENERS-1) fatal("Too many listeners");
+      tcp_addrs[n_tcp++] = argv[++i];
+    }
+    if (!strcmp(argv[i], "-connect") && i+1 < argc) {
+      client = 1;
+      client_addr = argv[++i];
+    }
+    if (!strcmp(argv[i], "-inetd")) inetd = 1;
+    if (!strcmp(argv[i], "-idle") && i+1 < argc)
+      idle_exit = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-resume") && i+1 < argc)
+      resume_grace = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-ticket") && i+1 < argc)
+      client_ticket = argv[++i];
+    if (!strcmp(argv[i], "-channels") && i+1 < argc)
+      client_channels = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-c") && i+1 < argc)
+      client_command = argv[++i];
+    if (!strcmp(argv[i], "-pty")) client_pty = 1;
+    if (!strcmp(argv[i], "-timing")) client_timing = 1;
+    if (!strcmp(argv[i], "-record") && i+1 < argc)
+      client_record = argv[++i];
+    if (!strcmp(argv[i], "-get") && i+2 < argc) {
+      xfer_state = XFER_WANTED;
+      xfer_msg = MSG_GET;
+      xfer_remote = argv[++i];
+      xfer_local = argv[++i];
+    }
+    if (!strcmp(argv[i], "-put") && i+2 < argc) {
+      xfer_state = XFER_WANTED;
+      xfer_msg = MSG_PUT;
+      xfer_local = argv[++i];
+      xfer_remote = argv[++i];
+    }
+    if (!strcmp(argv[i], "-maxconn") && i+1 < argc)
+      max_conn = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-maxperuid") && i+1 < argc)
+      max_per_uid = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-maxtcp") && i+1 < argc)
+      max_tcp = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-maxjobs") && i+1 < argc)
+      max_jobs = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-cgroup") && i+1 < argc)
+      cgroup_parent = argv[++i];
+    if (!strcmp(argv[i], "-cpuweight") && i+1 < argc)
+      cgroup_cpu_weight = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-memorymax") && i+1 < argc)
+      cgroup_memory_max = atoll(argv[++i]);
+    if (!strcmp(argv[i], "-placement") && i+1 < argc)
+      os_placement = argv[++i];
+    if (!strcmp(argv[i], "-backlog") && i+1 < argc)
+      net_opts.backlog = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-keepalive")) net_opts.keepalive = 1;
+    if (!strcmp(argv[i], "-sndbuf") && i+1 < argc)
+      net_opts.sndbuf = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-rcvbuf") && i+1 < argc)
+      net_opts.rcvbuf = atoi(argv[++i]);
+    if (!strcmp(argv[i], "-maxframe") && i+1 < argc)
+      set_frame_max(&frame_max.recv, atoi(argv[++i]));
+    if (!strcmp(argv[i], "-window") && i+1 < argc)
+      set_flow_window(atoi(argv[++i]));
+    if (!strcmp(argv[i], "-compress") && i+1 < argc) {
+      compress_level = atoi(argv[++i]);
+      client_compress = compress_level > 0;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (client) return client_main();
+
+  if (getuid() != 0 || geteuid() != 0)
+    fatal("Daemon must run as root");
+
+  /* Every listener is polled from the one loop. Unless a launcher passed
+   * them in, the UNIX socket is served at index 0, then any -tcp ones. */
+  int listen_fds[MAX_LISTENERS], listen_tcp[MAX_LISTENERS];
+  int n_listeners = 0;
+  const char* handoff = getenv(RESTART_ENV);
+  if (handoff) {
+    n_listeners = daemon_adopt(handoff, listen_fds, &next_conn);
+    (void)unsetenv(RESTART_ENV);
+    if (n_listeners < 1) fatal("Bad %s handed over", RESTART_ENV);
+    logkv(LOG_INFO, "event=restarted active=%d", n_active);
+  } else if (inetd || (n_listeners = launcher_adopt(listen_fds)) > 0) {
+    /* The launcher owns the socket and supervises us: we mustn't detach,
+     * and there's no socket file of our own to check or create. */
+    if (inetd) {
+      if ((client_fd = dup(0)) < 0) perror_fatal("dup()");
+      stdio_to_null();
+    }
+    log_open(logfile);
+    if (chdir("/") < 0) log_perror("chdir()");
+    umask(077);
+  } else {
+    if (is_un_connectable(SOCK_NAME))
+      fatal("Daemon already running");
+    if (!debug_) daemonize();
+    /* In debug mode, stay synchronous on stderr unless asked otherwise. */
+    if (!debug_ || logfile) log_open(logfile);
+  }
+  /* No limit is still as many as we can track. */
+  if (max_conn <= 0 || max_conn > MAX_ACTIVE) max_conn = MAX_ACTIVE;
+  cgroup_setup();
+  acct_open();
+  /* Before the listener has taken on anything else, as small as it will be. */
+  if (!debug_ && !inetd) zygote_start(listen_fds, n_listeners);
+
+  if (!n_listeners && !inetd) {
+    (void)unlink(SOCK_NAME);
+    listen_fds[n_listeners++] = un_listen(SOCK_NAME);
+    for (i = 0; i < n_tcp; ++i)
+      listen_fds[n_listeners++] = tcp_listen(tcp_addrs[i]);
+    for (i = 0; i < n_listeners; ++i)
+      if (listen_fds[i] < 0) fatal("Could not listen");
+  }
+  for (i = 0; i < n_listeners; ++i) listen_tcp[i] = is_tcp(listen_fds[i]);
+
+  if (inetd) {
+    /* The connection is already accepted: greet it as pending_accept()
+     * would, and simply wait here for its answer. */
+    conn_id = ++next_conn;
+    if (is_tcp(client_fd)) tcp_setsockopts(client_fd);
+    signal(SIGALRM, auth_timeout);
+    alarm(PENDING_TIMEOUT);
+    if (write_maxframe(client_fd, frame_max.recv) < 0 ||
+        write_text(client_fd, "Username: ") < 0 ||
+        write_prompt(client_fd, 1) < 0)
+      daemon_fatal("Unexpected disconnection");
+    login_msg = read_msg_type(client_fd);
+    if (login_msg != MSG_REPLY && (login_msg != MSG_RESUME || !resume_grace))
+      daemon_fatal("Bad message id %d", login_msg);
+    if (!(login_reply = read_str(client_fd)))
+      daemon_fatal("Unexpected disconnection");
+    alarm(0);
+  } else {
+    if (pipe(restart_pipe) < 0) perror_fatal("pipe()");
+    for (i = 0; i < 2; ++i) {
+      (void)fcntl(restart_pipe[i], F_SETFL, O_NONBLOCK);
+      (void)fcntl(restart_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    signal(SIGUSR2, restart_handler);
+  }
+
+  time_t idle_since = time(0);
+  while (!inetd) {
+    struct pollfd fds[MAX_LISTENERS + MAX_PENDING + MAX_ACTIVE];
+    int n = 0, timeout = -1, ready = -1, live[2];
+    time_t now = time(0);
+
+    if (restart_wanted && !n_pending)
+      daemon_restart(listen_fds, n_listeners, next_conn);
+    /* With -idle, go once there's been nothing to do for long enough; our
+     * launcher starts us again for the next connection. */
+    if (idle_exit && !n_pending && !n_active && !restart_wanted) {
+      int left = (int)(idle_since + idle_exit - now);
+      if (left <= 0) {
+        logkv(LOG_INFO, "event=idle secs=%d", idle_exit);
+        log_close();
+        return 0;
+      }
+      timeout = left*1000;
+    }
+    /* While a restart waits, new connections wait in the backlog. */
+    for (i = 0; i < n_listeners; ++i) {
+      fds[n].fd = restart_wanted ? -1 : listen_fds[i];
+      fds[n++].events = POLLIN;
+    }
+    for (i = 0; i < n_pending; ++i) {
+      int left = (int)(pending[i].deadline - now);
+      if (pending[i].m.str) left = 0; /* answered, awaiting its fork */
+      if (timeout < 0 || left*1000 < timeout)
+        timeout = left > 0 ? left*1000 : 0;
+      fds[n].fd = pending[i].fd;
+      fds[n++].events = POLLIN;
+    }
+    for (i = 0; i < n_active; ++i) {
+      fds[n].fd = active[i].fd;
+      fds[n++].events = POLLIN;
+    }
+    fds[n].fd = restart_pipe[0];
+    fds[n++].events = POLLIN;
+    rv = poll(fds, n, timeout);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0) perror_fatal("poll()");
+
+    now = time(0);
+    if (rv > 0 || n_pending || n_active) idle_since = now;
+    if (fds[n-1].revents) {
+      char buf[16];
+      while (read(restart_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+    }
+    for (i = n_active; i > 0; --i) {
+      if (!fds[n_listeners+n_pending+i-1].revents) continue;
+      (void)close(active[i-1].fd);
+      active[i-1] = active[--n_active];
+    }
+    for (i = n_pending; i > 0; --i) {
+      struct pending* p = &pending[i-1];
+      int done = 0;
+      if (p->m.str || fds[n_listeners+i-1].revents)
+        done = read_nb_msg(p->fd, &p->m);
+      if (done == 0 && now < p->deadline) continue;
+      if (done == 1 &&
+          (p->m.msg == MSG_REPLY ||
+           (p->m.msg == MSG_RESUME && resume_grace))) {
+        /* Fork one per pass; any others are picked up next time round. */
+        if (ready < 0) ready = i-1;
+        continue;
+      }
+      pending_drop(i-1);
+    }
+    for (i = 0; i < n_listeners; ++i)
+      if (fds[i].revents)
+        pending_accept(listen_fds[i], listen_tcp[i], ++next_conn);
+    if (ready < 0) continue;
+
+    /* The client has committed to logging in: only now do we create the
+     * processes for the connection. */
+    client_fd = pending[ready].fd;
+    conn_id = pending[ready].conn_id;
+    active[n_active].uid = pending[ready].uid;
+    login_msg = pending[ready].m.msg;
+    if (!(login_reply = strdup(pending[ready].m.str))) fatal("malloc()");
+    buffer_scrub(&pending[ready].m, sizeof(pending[ready].m));
+    pending[ready] = pending[--n_pending];
+    if (fcntl(client_fd, F_SETFL, 0) < 0) perror_fatal("fcntl()");
+    if (debug_) break;
+    if (pipe(live) < 0) perror_fatal("pipe()");
+    if (zygote_spawn(conn_id, live[1], listen_fds, n_listeners) < 0) {
+      logmsg(LOG_ERR, "Could not start connection %u", conn_id);
+      (void)close(live[0]);
+    } else {
+      active[n_active++].fd = live[0];
+    }
+    (void)close(live[1]);
+    (void)close(client_fd);
+    client_fd = -1;
+    buffer_scrub(login_reply, strlen(login_reply));
+    free(login_reply);
+    login_reply = 0;
+  }
+  /* Only -debug and -inetd run the connection in this process. */
+  while (n_pending) (void)close(pending[--n_pending].fd);
+  while (n_active) (void)close(active[--n_active].fd);
+  for (i = 0; i < n_listeners; ++i)
+    if (close(listen_fds[i]) < 0) log_perror("close(listen_fd)");
+  (void)close(restart_pipe[0]);
+  (void)close(restart_pipe[1]);
+  if (inetd) {
+    /* As in zygote_main(): the session's setlogin() mustn't reach inetd's
+     * session. EPERM means we already lead a process group, which inetd's
+     * fresh child doesn't; only when started by hand. */
+    if (setsid() < 0 && errno != EPERM) perror_fatal("setsid(inetd)");
+    os_daemon_post_fork();
+  }
+  return connection_main(conn_id);
+}
+
 /*
  * Protocol:
  *   Server to client:
  *     int MSG_FINISH int error
  *     int MSG_TEXT str text
  *     int MSG_PROMPT int echo
+ *     int MSG_CHANNEL int channel, then one of the above
+ *     int MSG_TICKET str ticket
+ *     int MSG_CHANNEL int channel, int MSG_DATA str data
+ *     int MSG_CHANNEL int channel, int MSG_PROGRESS int64 done int64 size
+ *     int MSG_CHANNEL int channel, int MSG_DATA ""  (a pty's command exited)
+ *     int MSG_CHANNEL int channel, int MSG_WINDOW int bytes  (input credit)
+ *     int MSG_COMPRESS int level      (the level agreed, or 0)
+ *     int MSG_CHANNEL int channel, int MSG_ZFRAME int msg str deflated
+ *                                     (in place of a MSG_TEXT or MSG_DATA)
+ *     int MSG_CHANNEL int channel, int MSG_JOB int job, then a MSG_TEXT
+ *                                     or MSG_ZFRAME of a command's output
+ *     int MSG_CHANNEL int channel, int MSG_JOB int job, int MSG_EXIT
+ *                                     int status  (the command finished)
+ *     int MSG_MAXFRAME int bytes      (first, before the username prompt)
  *   Client to server:
  *     int MSG_REPLY str text
+ *     int MSG_RESUME str ticket       (instead of the first reply)
+ *     int MSG_CHANNEL int channel, int MSG_REPLY str text
+ *     int MSG_OPEN int channel
+ *     int MSG_MAXFRAME int bytes      (once the command loop starts)
+ *     int MSG_CHANNEL int channel, int MSG_DATA str input  ("" for EOF)
+ *     int MSG_CHANNEL int channel, int MSG_PTY int rows int cols
+ *                                     (before the command's reply)
+ *     int MSG_CHANNEL int channel, int MSG_WINCH int rows int cols
+ *     int MSG_CHANNEL int channel, int MSG_WINDOW int bytes  (output credit)
+ *     int MSG_COMPRESS int level      (once the command loop starts)
+ *     int MSG_CHANNEL int channel, int MSG_ZFRAME int msg str deflated
+ *     int MSG_CHANNEL int channel, then a file transfer (see xfer.h):
+ *       int MSG_GET int64 offset str path
+ *       int MSG_PUT int64 offset int64 size str path
+ *       int MSG_DATA str data
+ *
+ * Text longer than the reader's MSG_MAXFRAME arrives as several MSG_TEXTs.
+ * MSG_DATA on a channel is the stdin of the latest command run on it.
+ * Commands are numbered as jobs in the order they're sent, and run several
+ * at a time, up to the daemon's -maxjobs; the rest wait their turn. The -c
+ * client exits with its command's status.
+ * The MSG_TEXT and MSG_DATA of a command, and a get's MSG_DATA, are sent
+ * only against the window the reader has granted for the channel (see
+ * net.h); a put's MSG_DATA isn't.
+ * A command run on a pty has its output gathered into fewer, larger
+ * MSG_TEXTs, held back no more than a few milliseconds.
+ * With -channels N, the client opens N channels once the command loop
+ * starts, and hands each line of input to whichever channel prompts next.
  */
+/* Tickets are single-use, so we remove the file as we read it. */
+static char* client_take_ticket()
+{
+  char buf[256];
+  FILE* f = fopen(client_ticket, "r");
+  if (!f) return 0;
+  char* ticket = fgets(buf, sizeof(buf), f);
+  fclose(f);
+  (void)unlink(client_ticket);
+  if (!ticket) return 0;
+  ticket[strcspn(ticket, "\n")] = '\0';
+  if (!(ticket = strdup(ticket))) fatal("malloc()");
+  buffer_scrub(buf, sizeof(buf));
+  return ticket;
+}
+
+static int client_progress(int sock, int channel, long long done,
+                           long long size)
+{
+  fprintf(stderr, "\r%lld/%lld bytes", done, size);
+  return 0;
+}
+
+/* Give a channel's output back its credit as we consume it, in batches. */
+static void client_consumed(int channel, int len)
+{
+  if (channel < 0 || channel >= client_channels) return;
+  out_unacked[channel] += len;
+  if (out_unacked[channel] < flow_window / 2) return;
+  msg_buf_put_uint(&client_out, MSG_CHANNEL);
+  msg_buf_put_uint(&client_out, channel);
+  msg_buf_put_uint(&client_out, MSG_WINDOW);
+  msg_buf_put_uint(&client_out, out_unacked[channel]);
+  out_unacked[channel] = 0;
+}
+
+/* Before writing directly, finish sending whatever is queued. */
+static void client_flush_out()
+{
+  struct pollfd pfd;
+  pfd.fd = client_fd;
+  pfd.events = POLLOUT;
+  while (client_out.len) {
+    int rv = msg_buf_flush(client_fd, &client_out);
+    if (rv < 0) client_fatal("Unexpected disconnection");
+    if (!rv && poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      perror_fatal("poll()");
+  }
+}
+
+/* Start the transfer asked for, on the first channel to prompt. */
+static void client_start_xfer(int channel)
+{
+  long long size;
+  int flags = xfer_msg == MSG_GET ? O_WRONLY|O_CREAT : O_RDONLY;
+  xfer_fd = xfer_open_local(xfer_local, flags, &size);
+  if (xfer_fd < 0) {
+    perror(xfer_local);
+    client_fatal(0);
+  }
+  xfer_state = XFER_ASKED;
+  xfer_channel = channel;
+  xfer_off = xfer_size = size;
+  if (write_channel(client_fd, channel) < 0 ||
+      (xfer_msg == MSG_GET ? write_get(client_fd, size, xfer_remote) :
+       write_put(client_fd, XFER_RESUME, size, xfer_remote)) < 0)
+    client_fatal("Unexpected disconnection");
+}
+
+static void client_xfer_msg(int msg, int channel)
+{
+  unsigned long long done, size;
+  int len, rv;
+  if (channel != xfer_channel) client_fatal("Bad message id %d", msg);
+  if (msg == MSG_PROGRESS) {
+    if (read_uint64(client_fd, &done) < 0 || read_uint64(client_fd, &size) < 0)
+      client_fatal("Unexpected disconnection");
+    client_progress(client_fd, channel, done, size);
+    /* The first MSG_PROGRESS of a put says where to start sending from. */
+    if (xfer_msg == MSG_PUT && xfer_state == XFER_ASKED) {
+      xfer_state = XFER_SENT;
+      client_flush_out();
+      if (done > (unsigned long long)xfer_size) done = xfer_size;
+      rv = xfer_send(client_fd, channel, xfer_fd, done, xfer_size,
+                     client_progress);
+      if (rv < 0) client_fatal("Unexpected disconnection");
+      if (rv) xfer_status = 1;
+    }
+    return;
+  }
+  if (xfer_msg != MSG_GET || (len = read_uint(client_fd)) < 0 ||
+      len > frame_max.recv)
+    client_fatal("Unexpected disconnection");
+  if (!len) return;
+  rv = xfer_recv(client_fd, xfer_fd, xfer_off, len);
+  if (rv < 0) client_fatal("Unexpected disconnection");
+  client_consumed(channel, len);
+  if (rv && !xfer_status) {
+    perror(xfer_local);
+    xfer_status = 1;
+  }
+  xfer_off += len;
+}
+
+static void client_text(int channel, char* text, int len)
+{
+  /* With -c, keep stdout for the command's output. */
+  FILE* out = channel < 0 && client_command ? stderr : stdout;
+  fwrite(text, 1, len, out);
+  fflush(out);
+  free(text);
+  client_consumed(channel, len);
+}
+
+/* With -c, everything we send goes through client_out, and is written only
+ * as fast as the server takes it; we must keep reading its output meanwhile,
+ * or we could both block writing to each other. */
+static void client_queue_reply(int channel, const char* str)
+{
+  msg_buf_put_uint(&client_out, MSG_CHANNEL);
+  msg_buf_put_uint(&client_out, channel);
+  msg_buf_put_uint(&client_out, MSG_REPLY);
+  msg_buf_put_uint(&client_out, strlen(str));
+  msg_buf_put(&client_out, str, strlen(str));
+}
+
+static void client_queue_winsize(int msg)
+{
+  struct winsize ws;
+  if (ioctl(fileno(stdin), TIOCGWINSZ, &ws) < 0 || !ws.ws_row || !ws.ws_col) {
+    ws.ws_row = 24;
+    ws.ws_col = 80;
+  }
+  msg_buf_put_uint(&client_out, MSG_CHANNEL);
+  msg_buf_put_uint(&client_out, stdin_channel);
+  msg_buf_put_uint(&client_out, msg);
+  msg_buf_put_uint(&client_out, ws.ws_row);
+  msg_buf_put_uint(&client_out, ws.ws_col);
+}
+
+static void client_restore_tty()
+{
+  if (tty_raw) (void)tcsetattr(fileno(stdin), TCSAFLUSH, &tty_saved);
+  tty_raw = 0;
+}
+
+static void client_winch(int sig) { winch = 1; }
+
+/* Ask for a pty for the command, and hand it our terminal. */
+static void client_start_pty()
+{
+  struct termios attrs;
+  client_queue_winsize(MSG_PTY);
+  if (!isatty(fileno(stdin)) || tcgetattr(fileno(stdin), &tty_saved) < 0)
+    return;
+  attrs = tty_saved;
+  cfmakeraw(&attrs);
+  if (tcsetattr(fileno(stdin), TCSAFLUSH, &attrs) < 0) return;
+  tty_raw = 1;
+  atexit(client_restore_tty);
+  signal(SIGWINCH, client_winch);
+}
+
+/* Copy our stdin to the command while waiting on the server, until EOF.
+ * Returns 1 once there's a message from the server to read. */
+static int client_pump_stdin()
+{
+  static char buf[FRAME_DEFAULT];
+  static char* packed = 0;
+  struct pollfd fds[2];
+  int chunk = bulk_chunk(client_fd), len;
+  if (winch) {
+    winch = 0;
+    client_queue_winsize(MSG_WINCH);
+  }
+  int reading = stdin_channel >= 0 && !client_out.len && !stdin_eof &&
+                stdin_credit > 0;
+  fds[0].fd = client_fd;
+  fds[0].events = client_out.len ? POLLIN|POLLOUT : POLLIN;
+  fds[1].fd = fileno(stdin);
+  fds[1].events = POLLIN;
+  if (poll(fds, reading ? 2 : 1, -1) < 0) {
+    if (errno == EINTR) return 0;
+    perror_fatal("poll()");
+  }
+  if (fds[0].revents & ~POLLOUT) return 1;
+  if (reading && fds[1].revents) {
+    int max = chunk < (int)sizeof(buf) ? chunk : sizeof(buf);
+    if (max > stdin_credit) max = stdin_credit;
+    ssize_t n = read(fds[1].fd, buf, max);
+    if (n < 0 && errno == EINTR) return 0;
+    if (n < 0) perror_fatal("read(stdin)");
+    stdin_credit -= n;
+    msg_buf_put_uint(&client_out, MSG_CHANNEL);
+    msg_buf_put_uint(&client_out, stdin_channel);
+    if (n >= ZFRAME_MIN && compress_active(client_fd)) {
+      if (!packed && !(packed = malloc(frame_max.send))) fatal("malloc()");
+      if ((len = compress_frame(client_fd, buf, n, packed)) < 0)
+        client_fatal("Compression failed");
+      msg_buf_put_uint(&client_out, MSG_ZFRAME);
+      msg_buf_put_uint(&client_out, MSG_DATA);
+      msg_buf_put_uint(&client_out, len);
+      msg_buf_put(&client_out, packed, len);
+    } else {
+      msg_buf_put_uint(&client_out, MSG_DATA);
+      msg_buf_put_uint(&client_out, n);
+      msg_buf_put(&client_out, buf, n);
+    }
+    if (n == 0) {
+      stdin_eof = 1;
+      /* The channel was offered back to us; we can close it now. */
+      if (stdin_prompt >= 0) client_queue_reply(stdin_prompt, "");
+    }
+  }
+  if (client_out.len && msg_buf_flush(client_fd, &client_out) < 0)
+    client_fatal("Unexpected disconnection");
+  return 0;
+}
+
+static void client_save_ticket(const char* ticket)
+{
+  int fd = open(client_ticket, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd < 0) { perror(client_ticket); return; }
+  if (write(fd, ticket, strlen(ticket)) < 0 || write(fd, "\n", 1) < 0)
+    perror(client_ticket);
+  (void)close(fd);
+}
+
 int client_main()
 {
-  client_fd = un_connect(SOCK_NAME);
+  int command_mode = 0, prompted = 0, channel, job, i, rv;
+  if (client_timing) timing_start = timing_now();
+  client_fd = client_addr ? tcp_connect(client_addr) : un_connect(SOCK_NAME);
   if (client_fd < 0) fatal("Failed to connect to server");
- 
+  if (client_record && record_start(client_fd, client_record) < 0)
+    fatal("Could not record to %s", client_record);
+  if (client_timing) {
+    timing_connect = timing_now();
+    atexit(timing_report);
+  }
+  /* Leave everything after the login lines unread, for the command. */
+  if (client_command) setvbuf(stdin, 0, _IONBF, 0);
+
   while(1) {
+    if ((client_out.len || (stdin_channel >= 0 && !stdin_eof)) &&
+        !client_pump_stdin())
+      continue;
     int msg = read_msg_type(client_fd);
+    channel = job = -1;
+    if (msg == MSG_CHANNEL) {
+      channel = read_uint(client_fd);
+      if (channel < 0) client_fatal("Unexpected disconnection");
+      if (!command_mode) {
+        command_mode = 1;
+        if (write_maxframe(client_fd, frame_max.recv) < 0)
+          client_fatal("Unexpected disconnection");
+        for (i = 1; i < client_channels; ++i)
+          if (write_open(client_fd, i) < 0)
+            client_fatal("Unexpected disconnection");
+        /* Let the output start flowing on every channel. */
+        if (!(out_unacked = calloc(client_channels, sizeof(int))))
+          fatal("malloc()");
+        for (i = 0; i < client_channels; ++i)
+          if (write_window(client_fd, i, flow_window) < 0)
+            client_fatal("Unexpected disconnection");
+        if (client_compress && write_compress(client_fd, compress_level) < 0)
+          client_fatal("Unexpected disconnection");
+      }
+      msg = read_msg_type(client_fd);
+      if (msg == MSG_JOB) {
+        job = read_uint(client_fd);
+        if (job < 0) client_fatal("Unexpected disconnection");
+        msg = read_msg_type(client_fd);
+      }
+      if (msg == MSG_CHANNEL || msg == MSG_JOB)
+        client_fatal("Bad message id %d", msg);
+    }
+    if (client_timing) timing_received(msg, channel);
     switch(msg) {
+    case MSG_MAXFRAME:
+      {
+        int size = read_uint(client_fd);
+        if (size < 0) client_fatal("Unexpected disconnection");
+        set_frame_max(&frame_max.send, size);
+      }
+      break;
+    case MSG_WINDOW:
+      {
+        int bytes = read_uint(client_fd);
+        if (bytes < 0) client_fatal("Unexpected disconnection");
+        if (channel >= 0 && channel == stdin_channel) stdin_credit += bytes;
+      }
+      break;
     case MSG_FINISH:
       {
         int status = read_uint(client_fd);
         if (status < 0) client_fatal("Unexpected disconnection");
-        return status ? 1 : 0;
+        if (channel < 0) return status || xfer_status ? 1 : command_status;
+        if (channel == xfer_channel) {
+          fputc('\n', stderr);
+          if (close(xfer_fd) < 0 || status) xfer_status = 1;
+          xfer_fd = xfer_channel = -1;
+        } else if (status) {
+          fprintf(stderr, "Channel %d refused\n", channel);
+        }
       }
+      break;
+    case MSG_EXIT:
+      {
+        int status = read_uint(client_fd);
+        if (status < 0) client_fatal("Unexpected disconnection");
+        if (client_command && channel >= 0 && channel == stdin_channel)
+          command_status = status;
+        else if (status)
+          fprintf(stderr, "Job %d exited with status %d\n", job, status);
+      }
+      break;
+    case MSG_PROGRESS:
+    case MSG_DATA:
+      /* A pty's command has gone; there'll be no EOF from the terminal. */
+      if (msg == MSG_DATA && channel >= 0 && channel == stdin_channel) {
+        if (read_uint(client_fd) != 0) client_fatal("Bad message id %d", msg);
+        if (!stdin_eof && stdin_prompt >= 0)
+          client_queue_reply(stdin_prompt, "");
+        stdin_eof = 1;
+        break;
+      }
+      client_xfer_msg(msg, channel);
+      break;
     case MSG_TEXT:
       {
-        char* text = read_str(client_fd);
+        int len;
+        char* text = read_strn(client_fd, &len);
         if (!text) client_fatal("Unexpected disconnection");
-        printf("%s", text);
-        fflush(stdout);
-        free(text);
+        client_text(channel, text, len);
+      }
+      break;
+    case MSG_ZFRAME:
+      {
+        int len;
+        char* payload = read_zframe(client_fd, &msg, &len);
+        if (!payload) client_fatal("Unexpected disconnection");
+        if (msg == MSG_TEXT) {
+          client_text(channel, payload, len);
+          break;
+        }
+        if (msg != MSG_DATA || channel < 0 || channel != xfer_channel ||
+            xfer_msg != MSG_GET)
+          client_fatal("Bad message id %d", msg);
+        rv = xfer_store(xfer_fd, xfer_off, payload, len);
+        free(payload);
+        client_consumed(channel, len);
+        if (rv && !xfer_status) {
+          perror(xfer_local);
+          xfer_status = 1;
+        }
+        xfer_off += len;
+      }
+      break;
+    case MSG_COMPRESS:
+      {
+        int level = read_uint(client_fd);
+        if (level < 0) client_fatal("Unexpected disconnection");
+        if (level && compress_start(client_fd, level) < 0)
+          client_fatal("Could not start compression");
+      }
+      break;
+    case MSG_TICKET:
+      {
+        char* ticket = read_str(client_fd);
+        if (!ticket) client_fatal("Unexpected disconnection");
+        if (client_ticket) client_save_ticket(ticket);
+        buffer_scrub(ticket, strlen(ticket));
+        free(ticket);
       }
       break;
     case MSG_PROMPT:
       {
         int echo = read_uint(client_fd);
         if (echo < 0) client_fatal("Unexpected disconnection");
+        if (channel >= 0 && xfer_state == XFER_WANTED) {
+          client_flush_out();
+          client_start_xfer(channel);
+          if (client_timing) timing_replied_to(channel, 0);
+          break;
+        }
+        if (channel >= 0 && client_command) {
+          const char* reply = "";
+          if (stdin_channel < 0) {
+            reply = client_command;
+            stdin_channel = channel;
+            if (client_pty) client_start_pty();
+          } else if (channel == stdin_channel && !stdin_eof) {
+            stdin_prompt = channel;
+            break;
+          }
+          client_queue_reply(channel, reply);
+          if (msg_buf_flush(client_fd, &client_out) < 0)
+            client_fatal("Unexpected disconnection");
+          if (client_timing) timing_replied_to(channel, 0);
+          break;
+        }
+        if (channel >= 0) {
+          fputs("Command: ", stdout);
+          fflush(stdout);
+        }
+        char* ticket = !prompted++ && client_ticket ? client_take_ticket() : 0;
+        if (ticket) {
+          fputc('\n', stdout);
+          rv = write_resume(client_fd, ticket);
+          buffer_scrub(ticket, strlen(ticket));
+          free(ticket);
+          if (rv < 0) client_fatal("Unexpected disconnection");
+          if (client_timing) timing_replied_to(channel, 0);
+          break;
+        }
         struct termios attrs;
         tcgetattr(fileno(stdin), &attrs);
         tcflag_t orig = attrs.c_lflag;
@@ -323,8 +1535,11 @@ int client_main()
           }
         }
         if (len) str[len-1] = '\0';
-        if (write_reply(client_fd, str) < 0)
+        client_flush_out();
+        if ((channel >= 0 && write_channel(client_fd, channel) < 0) ||
+            write_reply(client_fd, str) < 0)
           client_fatal("Unexpected disconnection");
+        if (client_timing) timing_replied_to(channel, 1);
         buffer_scrub(buf, sizeof(buf));
       }
       break;
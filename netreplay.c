@@ -0,0 +1,318 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+/*
+ * Replays transcripts recorded with the client's -record against a running
+ * daemon, to load it with real conversations instead of made-up ones. Each
+ * transcript is played on a connection of its own, by -n COPIES processes at
+ * once, and each run's time is reported, with a summary for the lot.
+ *
+ * The client's side of the conversation is sent as recorded, with each
+ * frame held back until the server has sent as many prompts as it had by
+ * then in the recording (and, for input to a command, has granted the window
+ * for it), and until its time comes: as recorded, or -speed X times faster,
+ * or with -max, as soon as the server is ready for it. The server's output is
+ * read and thrown away; window grants for it are made unlimited at the start.
+ *
+ * Passwords and resumption tickets aren't in transcripts, so replies to
+ * them go as empty lines: run the daemon with -noauth, or record as a user
+ * with no password. Compressed input replays as recorded, so the daemon
+ * must agree to -compress as it did.
+ *
+ * Usage: netreplay [-connect ADDR] [-speed X | -max] [-n COPIES] TRANSCRIPT...
+ */
+
+#include <config.h>
+#include "util.h"
+#include "log.h"
+#include "net.h"
+#include "record.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define CHANNELS_MAX 64
+/* Give up on a run once the server has been quiet this long, when it owes
+ * us a reply. */
+#define STALL_SECS 30
+
+static const char* addr = 0;
+static double speed = 1;
+static int max_speed = 0;
+
+struct run {
+  int ok, sent, received;
+  double elapsed;
+};
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int tagged_(int channel)
+{
+  return channel >= 0 && channel < CHANNELS_MAX;
+}
+
+#if HAVE_ZLIB
+/* How much input a compressed frame stands for. The client's frames are one
+ * deflate stream, so they have to be inflated in order. */
+static int unpacked_len(z_stream* z, const char* buf, int len)
+{
+  char out[16384];
+  int total = 0, rv;
+  z->next_in = (Bytef*)buf;
+  z->avail_in = len;
+  do {
+    z->next_out = (Bytef*)out;
+    z->avail_out = sizeof(out);
+    rv = inflate(z, Z_SYNC_FLUSH);
+    if (rv != Z_OK && rv != Z_BUF_ERROR) return -1;
+    total += sizeof(out) - z->avail_out;
+  } while (z->avail_in || !z->avail_out);
+  return total;
+}
+#endif
+
+/* The window each of the client's frames takes up: its input to a command,
+ * before any compression. Returns 0 if the transcript can't be replayed. */
+static int* input_lens(const char* path, const struct record* recs, int n)
+{
+  int i, *lens = calloc(n, sizeof(int));
+  struct frame f;
+#if HAVE_ZLIB
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (inflateInit(&z) != Z_OK) fatal("netreplay: inflateInit()");
+#endif
+  if (!lens) fatal("malloc()");
+  for (i = 0; i < n; ++i) {
+    if (frame_parse(recs[i].buf, recs[i].kept, &f) <= 0) {
+      logmsg(LOG_ERR, "%s: bad frame %d", path, i);
+      goto fail;
+    }
+    if (recs[i].flags & RECORD_SERVER) continue;
+    if (f.msg == MSG_DATA) lens[i] = f.len - f.header;
+    if (f.msg != MSG_ZFRAME) continue;
+#if HAVE_ZLIB
+    lens[i] = unpacked_len(&z, recs[i].buf + f.header, f.len - f.header);
+    if (lens[i] >= 0) {
+      if (f.arg != MSG_DATA) lens[i] = 0;
+      continue;
+    }
+#endif
+    logmsg(LOG_ERR, "%s: can't inflate frame %d", path, i);
+    goto fail;
+  }
+#if HAVE_ZLIB
+  inflateEnd(&z);
+#endif
+  return lens;
+ fail:
+#if HAVE_ZLIB
+  inflateEnd(&z);
+#endif
+  free(lens);
+  return 0;
+}
+
+/* Play one transcript on a new connection, filling in run. */
+static void replay(const struct record* recs, const int* lens, int n,
+                   struct run* run)
+{
+  int prompts = 0, want_prompts = 0, next = 0, fd, rv;
+  long long credit[CHANNELS_MAX];
+  char windowed[CHANNELS_MAX];
+  struct msg_buf in = { 0 }, out = { 0 };
+  struct frame f;
+  double start, at = 0, due;
+
+  memset(credit, 0, sizeof(credit));
+  memset(windowed, 0, sizeof(windowed));
+  memset(run, 0, sizeof(*run));
+  fd = addr ? tcp_connect(addr) : un_connect(SOCK_NAME);
+  if (fd < 0) return;
+  start = now();
+
+  while (1) {
+    /* Take the transcript as far as the server and the clock allow. */
+    due = -1;
+    while (next < n) {
+      const struct record* r = &recs[next];
+      (void)frame_parse(r->buf, r->kept, &f);
+      if (r->flags & RECORD_SERVER) {
+        if (f.msg == MSG_PROMPT) ++want_prompts;
+      } else {
+        if (prompts < want_prompts) break;
+        if (lens[next] && tagged_(f.channel) && credit[f.channel] < lens[next])
+          break;
+        if (!max_speed && (due = (at + r->usec/1e6) / speed -
+                                 (now() - start)) > 0)
+          break;
+        due = -1;
+        if (f.msg != MSG_WINDOW || !tagged_(f.channel)) {
+          msg_buf_put(&out, r->buf, r->kept);
+          if (tagged_(f.channel)) credit[f.channel] -= lens[next];
+        } else if (!windowed[f.channel]++) {
+          msg_buf_put_uint(&out, MSG_CHANNEL);
+          msg_buf_put_uint(&out, f.channel);
+          msg_buf_put_uint(&out, MSG_WINDOW);
+          msg_buf_put_uint(&out, 1 << 30);
+        }
+        ++run->sent;
+      }
+      at += r->usec/1e6;
+      ++next;
+    }
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (out.len) pfd.events |= POLLOUT;
+    rv = poll(&pfd, 1, due > 0 ? (int)(due * 1000) + 1 : STALL_SECS*1000);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0) { log_perror("netreplay:poll()"); goto done; }
+    if (rv == 0) {
+      if (due > 0) continue;
+      logmsg(LOG_ERR, "netreplay: server stalled at frame %d", next);
+      goto done;
+    }
+    if ((pfd.revents & POLLOUT) && msg_buf_flush(fd, &out) < 0) goto done;
+    if (!(pfd.revents & (POLLIN|POLLHUP|POLLERR))) continue;
+    in.len = 0;
+    if (msg_buf_read(fd, read_msg_type(fd), ~0u, &in) < 0) {
+      /* Hanging up once we've had our say is a normal ending. */
+      run->ok = next == n && !out.len;
+      goto done;
+    }
+    ++run->received;
+    if (frame_parse(in.buf, in.len, &f) <= 0) goto done;
+    if (f.msg == MSG_PROMPT) ++prompts;
+    if (f.msg == MSG_WINDOW && tagged_(f.channel))
+      credit[f.channel] += f.arg;
+    if (f.msg == MSG_FINISH && f.channel < 0) {
+      run->ok = next == n;
+      goto done;
+    }
+  }
+ done:
+  run->elapsed = now() - start;
+  (void)close(fd);
+  free(in.buf);
+  free(out.buf);
+}
+
+/* Run copies of one transcript at once, each in its own process, and
+ * print how they went. Returns the number that failed. */
+static int replay_copies(const char* path, int copies, struct run* runs)
+{
+  int i, n, result[2], failed = 0, *lens;
+  struct record* recs = record_load(path, &n);
+  memset(runs, 0, copies * sizeof(*runs));
+  if (!recs) return copies;
+  if (!(lens = input_lens(path, recs, n))) {
+    while (n) free(recs[--n].buf);
+    free(recs);
+    return copies;
+  }
+  if (pipe(result) < 0) perror_fatal("netreplay:pipe()");
+  fflush(0);
+  for (i = 0; i < copies; ++i) {
+    int pid = fork();
+    if (pid < 0) perror_fatal("netreplay:fork()");
+    if (pid == 0) {
+      struct run run;
+      (void)close(result[0]);
+      replay(recs, lens, n, &run);
+      _exit(write(result[1], &run, sizeof(run)) == sizeof(run) ? 0 : 1);
+    }
+  }
+  (void)close(result[1]);
+  for (i = 0; i < copies; ++i) {
+    if (read(result[0], &runs[i], sizeof(runs[i])) != sizeof(runs[i]))
+      memset(&runs[i], 0, sizeof(runs[i]));
+    if (!runs[i].ok) ++failed;
+    printf("%-24s %5d %8d %8d %10.2f %s\n", path, i + 1, runs[i].sent,
+           runs[i].received, runs[i].elapsed * 1000,
+           runs[i].ok ? "ok" : "FAILED");
+  }
+  (void)close(result[0]);
+  while (wait(0) > 0 || errno == EINTR)
+    ;
+  while (n) free(recs[--n].buf);
+  free(recs);
+  free(lens);
+  return failed;
+}
+
+int main(int argc, char** argv)
+{
+  int i, j, copies = 1, runs = 0, failed = 0;
+  double total = 0, best = 0, worst = 0, start;
+  struct run* batch;
+  signal(SIGPIPE, SIG_IGN);
+  frame_max.send = frame_max.recv = 1 << 30;
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-connect") && i+1 < argc) addr = argv[++i];
+    else if (!strcmp(argv[i], "-speed") && i+1 < argc) speed = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-max")) max_speed = 1;
+    else if (!strcmp(argv[i], "-n") && i+1 < argc) copies = atoi(argv[++i]);
+    else if (argv[i][0] == '-') fatal("netreplay: unknown option %s", argv[i]);
+    else break;
+  }
+  if (i == argc) {
+    fprintf(stderr, "Usage: netreplay [-connect ADDR] [-speed X | -max] "
+                    "[-n COPIES] TRANSCRIPT...\n");
+    return 2;
+  }
+  if (speed <= 0) speed = 1;
+  if (copies < 1) copies = 1;
+  if (!(batch = malloc(copies * sizeof(*batch)))) fatal("malloc()");
+
+  printf("%-24s %5s %8s %8s %10s\n", "transcript", "run", "sent", "recvd",
+         "ms");
+  start = now();
+  for (; i < argc; ++i) {
+    failed += replay_copies(argv[i], copies, batch);
+    for (j = 0; j < copies; ++j, ++runs) {
+      total += batch[j].elapsed;
+      if (!runs || batch[j].elapsed < best) best = batch[j].elapsed;
+      if (batch[j].elapsed > worst) worst = batch[j].elapsed;
+    }
+  }
+  printf("%d runs, %d failed: mean %.2f ms, best %.2f ms, worst %.2f ms, "
+         "%.1f runs/s\n", runs, failed, total / runs * 1000, best * 1000,
+         worst * 1000, runs / (now() - start));
+  free(batch);
+  return failed ? 1 : 0;
+}
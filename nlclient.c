@@ -0,0 +1,402 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#include "nlclient.h"
+#include "util.h"
+#include "log.h"
+#include "net.h"
+#include "record.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <errno.h>
+
+/* How long nlc_close() waits for the session to see itself out, in ms. */
+#define CLOSE_WAIT 1000
+
+struct nlc {
+  int fd, state;
+  char *addr, *user;
+  struct nlc_callbacks cb;
+  void* arg;
+  int prompts, command_mode, jobs, next_job;
+  /* Flow control on the channel: what we may send, and what we've taken of
+   * the output and not yet granted back. */
+  int credit, unacked, send_max;
+  /* Login text, for the next prompt. */
+  char* text;
+  int text_len;
+  char* in;
+  int in_len, in_cap;
+  struct msg_buf out;
+};
+
+/* Returns -1 if out of memory. */
+static int strdup_or_0_(char** copy, const char* s)
+{
+  *copy = 0;
+  return s && !(*copy = strdup(s)) ? -1 : 0;
+}
+
+static void put_channel_(struct nlc* c, int msg)
+{
+  msg_buf_put_uint(&c->out, MSG_CHANNEL);
+  msg_buf_put_uint(&c->out, 0);
+  msg_buf_put_uint(&c->out, msg);
+}
+
+static void put_reply_(struct nlc* c, int tagged, const char* str)
+{
+  if (tagged) put_channel_(c, MSG_REPLY);
+  else msg_buf_put_uint(&c->out, MSG_REPLY);
+  msg_buf_put_uint(&c->out, strlen(str));
+  msg_buf_put(&c->out, str, strlen(str));
+}
+
+/* Also where running out of memory while building a frame (which leaves
+ * c->out failed) fails the connection. */
+static void flush_(struct nlc* c)
+{
+  if ((c->out.len || c->out.failed) && msg_buf_flush(c->fd, &c->out) < 0)
+    c->state = NLC_FAILED;
+}
+
+/* Pass on any login text that no prompt came after. */
+static void notice_(struct nlc* c)
+{
+  if (c->text_len && c->cb.output) c->cb.output(c->arg, -1, c->text,
+                                                c->text_len);
+  c->text_len = 0;
+}
+
+static void login_frame_(struct nlc* c, const struct frame* f,
+                         const char* payload, int len)
+{
+  const char* answer;
+  switch (f->msg) {
+  case MSG_MAXFRAME:
+    set_frame_max(&c->send_max, f->arg);
+    break;
+  case MSG_TEXT:
+    {
+      char* text = realloc(c->text, c->text_len + len + 1);
+      if (!text) {
+        c->state = NLC_FAILED;
+        break;
+      }
+      memcpy(text + c->text_len, payload, len);
+      c->text = text;
+      c->text_len += len;
+      c->text[c->text_len] = '\0';
+    }
+    break;
+  case MSG_PROMPT:
+    /* The first is for the username, which we know. */
+    if (!c->prompts++) answer = c->user;
+    else answer = c->cb.prompt ? c->cb.prompt(c->arg, c->text_len ? c->text :
+                                              "", f->arg) : 0;
+    if (c->text) buffer_scrub(c->text, c->text_len);
+    c->text_len = 0;
+    if (!answer) { c->state = NLC_FAILED; break; }
+    put_reply_(c, 0, answer);
+    break;
+  case MSG_FINISH:
+    notice_(c);
+    c->state = f->arg ? NLC_FAILED : NLC_CLOSED;
+    break;
+  case MSG_TICKET:
+    break;
+  default:
+    c->state = NLC_FAILED;
+    break;
+  }
+}
+
+static void channel_frame_(struct nlc* c, const struct frame* f,
+                           const char* payload, int len)
+{
+  if (!c->command_mode) {
+    /* Logged in: say what we'll take, and let the output flow. */
+    c->command_mode = 1;
+    c->state = NLC_BUSY;
+    notice_(c);
+    msg_buf_put_uint(&c->out, MSG_MAXFRAME);
+    msg_buf_put_uint(&c->out, FRAME_DEFAULT);
+    put_channel_(c, MSG_WINDOW);
+    msg_buf_put_uint(&c->out, WINDOW_DEFAULT);
+  }
+  switch (f->msg) {
+  case MSG_PROMPT:
+    c->state = NLC_READY;
+    break;
+  case MSG_TEXT:
+    if (c->cb.output) c->cb.output(c->arg, f->job, payload, len);
+    c->unacked += len;
+    if (c->unacked >= WINDOW_DEFAULT / 2) {
+      put_channel_(c, MSG_WINDOW);
+      msg_buf_put_uint(&c->out, c->unacked);
+      c->unacked = 0;
+    }
+    break;
+  case MSG_EXIT:
+    --c->jobs;
+    if (c->cb.exit) c->cb.exit(c->arg, f->job, f->arg);
+    break;
+  case MSG_WINDOW:
+    c->credit += f->arg;
+    break;
+  case MSG_DATA:   /* a pty's command has gone */
+  case MSG_FINISH: /* the channel is closed; the session's FINISH follows */
+    break;
+  default:
+    c->state = NLC_FAILED;
+    break;
+  }
+}
+
+struct nlc* nlc_connect(const char* addr, const char* user,
+                        const struct nlc_callbacks* cb, void* arg)
+{
+  struct nlc* c;
+  int fd = addr ? tcp_connect(addr) : un_connect(SOCK_NAME);
+  if (fd < 0) return 0;
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) log_perror("fcntl()");
+  if (!(c = calloc(1, sizeof(*c))) || strdup_or_0_(&c->addr, addr) < 0 ||
+      strdup_or_0_(&c->user, user) < 0) {
+    if (c) free(c->addr);
+    free(c);
+    (void)close(fd);
+    return 0;
+  }
+  c->fd = fd;
+  c->state = NLC_LOGIN;
+  if (cb) c->cb = *cb;
+  c->arg = arg;
+  c->send_max = FRAME_DEFAULT;
+  return c;
+}
+
+int nlc_fd(const struct nlc* c) { return c->fd; }
+int nlc_state(const struct nlc* c) { return c->state; }
+int nlc_jobs(const struct nlc* c) { return c->jobs; }
+
+int nlc_events(const struct nlc* c)
+{
+  if (c->state >= NLC_CLOSED) return 0;
+  return c->out.len ? POLLIN|POLLOUT : POLLIN;
+}
+
+int nlc_process(struct nlc* c)
+{
+  struct frame f;
+  int off, rv;
+  flush_(c);
+  while (c->state < NLC_CLOSED) {
+    if (c->in_cap - c->in_len < 4096) {
+      int cap = c->in_cap ? 2*c->in_cap : 16384;
+      char* in = realloc(c->in, cap);
+      if (!in) {
+        c->state = NLC_FAILED;
+        break;
+      }
+      c->in = in;
+      c->in_cap = cap;
+    }
+    ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len,
+                     MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (n <= 0) {
+      c->state = NLC_FAILED;
+      break;
+    }
+    c->in_len += n;
+
+    off = 0;
+    while (c->state < NLC_CLOSED &&
+           (rv = frame_parse(c->in + off, c->in_len - off, &f)) != 0) {
+      if (rv < 0 || f.len > FRAME_DEFAULT + 64) {
+        c->state = NLC_FAILED;
+        break;
+      }
+      if (f.len > c->in_len - off) break;
+      if (f.channel < 0)
+        login_frame_(c, &f, c->in + off + f.header, f.len - f.header);
+      else if (f.channel == 0)
+        channel_frame_(c, &f, c->in + off + f.header, f.len - f.header);
+      else
+        c->state = NLC_FAILED;
+      off += f.len;
+    }
+    buffer_scrub(c->in, off);
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+  }
+  flush_(c);
+  return c->state;
+}
+
+int nlc_wait(struct nlc* c, int timeout)
+{
+  struct pollfd pfd;
+  if (c->state >= NLC_CLOSED) return c->state;
+  pfd.fd = c->fd;
+  pfd.events = nlc_events(c);
+  if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+    log_perror("nlc_wait:poll()");
+    c->state = NLC_FAILED;
+    return c->state;
+  }
+  return nlc_process(c);
+}
+
+int nlc_run(struct nlc* c, const char* command)
+{
+  if (c->state != NLC_READY || !command[0]) return -1;
+  put_reply_(c, 1, command);
+  c->state = NLC_BUSY;
+  ++c->jobs;
+  flush_(c);
+  if (c->state == NLC_FAILED) return -1;
+  return ++c->next_job;
+}
+
+int nlc_input(struct nlc* c, const char* buf, int len)
+{
+  int eof = len == 0;
+  if (c->state != NLC_READY && c->state != NLC_BUSY) return -1;
+  if (len > c->credit) len = c->credit;
+  if (len > c->send_max) len = c->send_max;
+  if (len <= 0 && !eof) return 0;
+  if (eof) len = 0;
+  put_channel_(c, MSG_DATA);
+  msg_buf_put_uint(&c->out, len);
+  msg_buf_put(&c->out, buf, len);
+  c->credit -= len;
+  flush_(c);
+  return c->state == NLC_FAILED ? -1 : len;
+}
+
+void nlc_close(struct nlc* c)
+{
+  if (!c) return;
+  /* Closing the channel ends the session, which then says goodbye. */
+  if (c->state == NLC_READY) {
+    int waited = 0;
+    struct timeval start, now;
+    put_reply_(c, 1, "");
+    memset(&c->cb, 0, sizeof(c->cb));
+    gettimeofday(&start, 0);
+    while (c->state < NLC_CLOSED && waited < CLOSE_WAIT) {
+      nlc_wait(c, CLOSE_WAIT - waited);
+      gettimeofday(&now, 0);
+      waited = (now.tv_sec - start.tv_sec) * 1000 +
+               (now.tv_usec - start.tv_usec) / 1000;
+    }
+  }
+  (void)close(c->fd);
+  if (c->text) buffer_scrub(c->text, c->text_len);
+  if (c->in) buffer_scrub(c->in, c->in_cap);
+  free(c->text);
+  free(c->in);
+  free(c->out.buf);
+  free(c->addr);
+  free(c->user);
+  free(c);
+}
+
+
+struct nlc_pool {
+  int max_idle, n_idle;
+  struct nlc** idle;
+};
+
+static int same_(const char* a, const char* b)
+{
+  return a && b ? !strcmp(a, b) : a == b;
+}
+
+struct nlc_pool* nlc_pool_new(int max_idle)
+{
+  struct nlc_pool* pool = calloc(1, sizeof(*pool));
+  if (max_idle < 1) max_idle = 1;
+  if (!pool || !(pool->idle = calloc(max_idle, sizeof(struct nlc*)))) {
+    free(pool);
+    return 0;
+  }
+  pool->max_idle = max_idle;
+  return pool;
+}
+
+static struct nlc* pool_take_(struct nlc_pool* pool, int i)
+{
+  struct nlc* c = pool->idle[i];
+  memmove(pool->idle + i, pool->idle + i + 1,
+          (pool->n_idle - i - 1) * sizeof(struct nlc*));
+  --pool->n_idle;
+  return c;
+}
+
+struct nlc* nlc_pool_get(struct nlc_pool* pool, const char* addr,
+                         const char* user, const struct nlc_callbacks* cb,
+                         void* arg)
+{
+  int i;
+  /* Newest first: the one least likely to have been dropped. */
+  for (i = pool->n_idle - 1; i >= 0; --i) {
+    struct nlc* c = pool->idle[i];
+    if (!same_(c->addr, addr) || !same_(c->user, user)) continue;
+    pool_take_(pool, i);
+    if (nlc_process(c) != NLC_READY) {
+      nlc_close(c);
+      continue;
+    }
+    if (cb) c->cb = *cb;
+    c->arg = arg;
+    return c;
+  }
+  return nlc_connect(addr, user, cb, arg);
+}
+
+void nlc_pool_put(struct nlc_pool* pool, struct nlc* c)
+{
+  if (!c) return;
+  if (c->state != NLC_READY || c->jobs) {
+    nlc_close(c);
+    return;
+  }
+  memset(&c->cb, 0, sizeof(c->cb));
+  c->arg = 0;
+  if (pool->n_idle == pool->max_idle) nlc_close(pool_take_(pool, 0));
+  pool->idle[pool->n_idle++] = c;
+}
+
+void nlc_pool_free(struct nlc_pool* pool)
+{
+  while (pool->n_idle) nlc_close(pool_take_(pool, pool->n_idle - 1));
+  free(pool->idle);
+  free(pool);
+}
@@ -0,0 +1,102 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef NLCLIENT_H__
+#define NLCLIENT_H__
+
+/*
+ * A client library (libnetlogin.a), for programs that run commands through
+ * netlogind themselves rather than by spawning netlogind -client. Nothing
+ * in it blocks once connected: the caller polls nlc_fd() for nlc_events(),
+ * calls nlc_process() when it's ready, and hears what came in through the
+ * callbacks. Commands all run on the connection's first channel, as the
+ * interactive client's do, and can overlap; the newest one gets the input.
+ * A pool keeps logged-in connections for reuse, so that a program running
+ * many commands as a user only logs in once.
+ *
+ * The library never exits the program: running out of memory, or file
+ * descriptors, fails the call or the connection. It does say why on stderr,
+ * as netlogind -client would (a failed connect(), say); redirect or close
+ * stderr to keep it quiet. Only the nlc_ names are exported; netlogind's own
+ * helpers are kept local.
+ */
+
+struct nlc;
+
+struct nlc_callbacks {
+  /* A login prompt after the username: whatever PAM asks for, with the text
+   * that came before it (echo is 0 for a password). Returns the answer,
+   * which is copied, or 0 to hang up. */
+  const char* (*prompt)(void* arg, const char* text, int echo);
+  /* Output from a job, or a notice from the server for job -1. */
+  void (*output)(void* arg, int job, const char* buf, int len);
+  /* A job has exited. */
+  void (*exit)(void* arg, int job, int status);
+};
+
+enum nlc_state {
+  NLC_LOGIN,  /* still logging in */
+  NLC_READY,  /* waiting for a command */
+  NLC_BUSY,   /* logged in, but the server hasn't asked for a command yet */
+  NLC_CLOSED, /* the session is over */
+  NLC_FAILED  /* login failed, or the connection broke */
+};
+
+/* Connect to addr ("[host:]port" over TCP, or 0 for the local socket) and
+ * start logging in as user. Returns 0 if it couldn't connect, or is out of
+ * memory. */
+struct nlc* nlc_connect(const char* addr, const char* user,
+                        const struct nlc_callbacks* cb, void* arg);
+int nlc_fd(const struct nlc* c);
+/* POLLIN, and POLLOUT while there's something to send. */
+int nlc_events(const struct nlc* c);
+/* Read and act on whatever has arrived, and send what we can. Returns the
+ * connection's state. */
+int nlc_process(struct nlc* c);
+int nlc_state(const struct nlc* c);
+/* Jobs started and not yet exited. */
+int nlc_jobs(const struct nlc* c);
+/* nlc_process() once the connection is ready, or after timeout ms (-1 for
+ * no limit); for callers with nothing else to wait for. */
+int nlc_wait(struct nlc* c, int timeout);
+
+/* Run a command, once the state is NLC_READY. Returns its job number, as
+ * passed to the callbacks, or -1. */
+int nlc_run(struct nlc* c, const char* command);
+/* Send input to the newest job, as much as the server has room for; len 0
+ * sends EOF. Returns the bytes taken, or -1. */
+int nlc_input(struct nlc* c, const char* buf, int len);
+
+/* End the session politely and free the connection. */
+void nlc_close(struct nlc* c);
+
+/* Idle connections, by address and user. nlc_pool_get() hands out one that
+ * is ready, with new callbacks, or else connects afresh; nlc_pool_put()
+ * takes it back once its jobs are done, keeping at most max_idle. */
+struct nlc_pool;
+/* Returns 0 if out of memory. */
+struct nlc_pool* nlc_pool_new(int max_idle);
+struct nlc* nlc_pool_get(struct nlc_pool* pool, const char* addr,
+                         const char* user, const struct nlc_callbacks* cb,
+                         void* arg);
+void nlc_pool_put(struct nlc_pool* pool, struct nlc* c);
+void nlc_pool_free(struct nlc_pool* pool);
+
+#endif
@@ -17,9 +17,13 @@
   SOFTWARE.
  */
 
+#ifdef __linux
+#define _GNU_SOURCE /* sched_setaffinity */
+#endif
 #include <config.h>
 #include "os.h"
 #include "util.h"
+#include "log.h"
 
 #if HAVE_BSM_AUDIT_H
 #include <unistd.h>
@@ -40,10 +44,21 @@
 #include <project.h>
 #endif
 
+#ifdef __linux
+#include <sched.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/syscall.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
+const char* os_placement = 0;
+unsigned os_session_seq = 0;
+
 void os_daemon_post_fork()
 {
 #ifdef __sun
@@ -111,7 +126,7 @@ void os_session_post_auth(char* username, uid_t uid)
     {
       debug("Skip setting audit-uid (auditing disabled for system)");
       audit_enabled = 0;
-    } else perror("getaudit_addr()");
+    } else log_perror("getaudit_addr()");
   }
   ai.ai_auid = uid;
 #ifdef AU_ASSIGN_ASID
@@ -132,13 +147,183 @@ void os_session_post_auth(char* username, uid_t uid)
   } if (au_user_mask(username, &ai.ai_mask) < 0) {
     au_mask_t null = {0,};
     ai.ai_mask = null;
-    perror("au_user_mask()"); /* Should this be fatal? */
+    log_perror("au_user_mask()"); /* Should this be fatal? */
   } else if (setaudit_addr(&ai, sizeof(ai)) < 0)
     perror_fatal("setaudit_addr()");
 #endif
 
 }
 
+#ifdef __linux
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#define MAX_NODES 1024
+/* Without a size given, "cpu" deals out this many CPUs at a time. */
+#define CPU_GROUP 4
+
+/* Parse a kernel-style CPU list, like "0-3,8". */
+static int parse_cpulist(const char* str, cpu_set_t* set)
+{
+  char* end;
+  CPU_ZERO(set);
+  while (*str && *str != '\n') {
+    long lo = strtol(str, &end, 10), hi = lo;
+    if (end == str) return -1;
+    if (*end == '-') {
+      str = end+1;
+      hi = strtol(str, &end, 10);
+      if (end == str) return -1;
+    }
+    if (lo < 0 || hi >= CPU_SETSIZE || lo > hi) return -1;
+    for (; lo <= hi; ++lo) CPU_SET(lo, set);
+    str = *end == ',' ? end+1 : end;
+  }
+  return 0;
+}
+
+static int read_cpulist(const char* path, cpu_set_t* set)
+{
+  char buf[4096];
+  FILE* f = fopen(path, "r");
+  if (!f) return -1;
+  char* line = fgets(buf, sizeof(buf), f);
+  fclose(f);
+  return line ? parse_cpulist(line, set) : -1;
+}
+
+/* The NUMA nodes that are online, from the one list the kernel keeps of
+ * them, rather than probing for each. Returns how many. */
+static int online_nodes(int* nodes)
+{
+  cpu_set_t set;
+  int n, n_nodes = 0;
+  if (read_cpulist("/sys/devices/system/node/online", &set) < 0) return 0;
+  for (n = 0; n < MAX_NODES && n < CPU_SETSIZE; ++n)
+    if (CPU_ISSET(n, &set)) nodes[n_nodes++] = n;
+  return n_nodes;
+}
+
+/* The CPUs of NUMA node n that we may use, or -1 if it has none. */
+static int node_cpus(int n, const cpu_set_t* allowed, cpu_set_t* set)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+  if (read_cpulist(path, set) < 0) return -1;
+  CPU_AND(set, set, allowed);
+  return CPU_COUNT(set) ? 0 : -1;
+}
+
+/* The CPUs in the first entry of the map file naming the user, or one of
+ * their groups as @group. Lines are "name cpulist"; # starts a comment. */
+static int mapped_cpus(const char* file, struct passwd* pw, cpu_set_t* set)
+{
+  char line[1024], name[256], cpus[768];
+  gid_t groups[256];
+  int n_groups = getgroups(256, groups), found = -1, i;
+  FILE* f = fopen(file, "r");
+  if (!f) { log_perror(file); return -1; }
+  while (found < 0 && fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%255s %767s", name, cpus) != 2 || name[0] == '#')
+      continue;
+    if (name[0] == '@') {
+      struct group gr, *grp;
+      char gr_buf[4096];
+      if (getgrnam_r(name+1, &gr, gr_buf, sizeof(gr_buf), &grp) || !grp)
+        continue;
+      for (i = 0; i < n_groups && groups[i] != grp->gr_gid; ++i)
+        ;
+      if (i == n_groups && grp->gr_gid != pw->pw_gid) continue;
+    } else if (strcmp(name, pw->pw_name)) {
+      continue;
+    }
+    found = parse_cpulist(cpus, set);
+    if (found < 0) logmsg(LOG_ERR, "%s: bad CPU list for %s", file, name);
+  }
+  fclose(f);
+  return found;
+}
+
+/* Pin the session, and so everything it runs, to some of the CPUs, with its
+ * memory preferably on their node if they share one. Placement is only an
+ * optimisation: if it fails, the session runs wherever it would have. */
+static void place_session(struct passwd* pw)
+{
+  cpu_set_t allowed, set, node_set;
+  int i, n, count, group, node = -1, nodes[MAX_NODES], n_nodes = 0;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    log_perror("sched_getaffinity()");
+    return;
+  }
+  count = online_nodes(nodes);
+  for (i = 0; i < count; ++i)
+    if (node_cpus(nodes[i], &allowed, &node_set) == 0)
+      nodes[n_nodes++] = nodes[i];
+
+  if (!strncmp(os_placement, "cpu", 3) &&
+      (!os_placement[3] || os_placement[3] == ':')) {
+    /* Groups of consecutive CPUs, so that a session's jobs still run side
+     * by side; the last group may be short. */
+    group = os_placement[3] ? atoi(os_placement+4) : CPU_GROUP;
+    count = CPU_COUNT(&allowed);
+    if (group < 1) group = 1;
+    if (group > count) group = count;
+    n = (int)(os_session_seq % ((count + group - 1) / group)) * group;
+    CPU_ZERO(&set);
+    for (i = 0; i < CPU_SETSIZE && group; ++i) {
+      if (!CPU_ISSET(i, &allowed) || n-- > 0) continue;
+      CPU_SET(i, &set);
+      --group;
+    }
+  } else if (!strcmp(os_placement, "node")) {
+    if (!n_nodes) {
+      logmsg(LOG_ERR, "No NUMA nodes found to place the session on");
+      return;
+    }
+    node = nodes[os_session_seq % n_nodes];
+    (void)node_cpus(node, &allowed, &set);
+  } else {
+    if (mapped_cpus(os_placement, pw, &set) < 0) return;
+    CPU_AND(&set, &set, &allowed);
+    if (!CPU_COUNT(&set)) {
+      logmsg(LOG_ERR, "No usable CPUs mapped for %s", pw->pw_name);
+      return;
+    }
+  }
+  /* Say which node the CPUs are on, if it's just the one. */
+  for (i = 0; node < 0 && i < n_nodes; ++i) {
+    (void)node_cpus(nodes[i], &allowed, &node_set);
+    CPU_AND(&node_set, &node_set, &set);
+    if (CPU_EQUAL(&node_set, &set)) node = nodes[i];
+  }
+
+  if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+    log_perror("sched_setaffinity()");
+    return;
+  }
+  if (node >= 0) {
+    unsigned long mask[MAX_NODES / (8*sizeof(unsigned long))] = {0,};
+    mask[node / (8*sizeof(unsigned long))] |=
+      1UL << (node % (8*sizeof(unsigned long)));
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NODES+1) < 0)
+      log_perror("set_mempolicy()");
+  }
+
+  char cpus[256];
+  int len = 0;
+  for (i = 0; i < CPU_SETSIZE && len < (int)sizeof(cpus) - 16; ++i) {
+    if (!CPU_ISSET(i, &set)) continue;
+    for (n = i; n+1 < CPU_SETSIZE && CPU_ISSET(n+1, &set); ++n)
+      ;
+    len += snprintf(cpus+len, sizeof(cpus)-len, "%s%d", len ? "," : "", i);
+    if (n > i) len += snprintf(cpus+len, sizeof(cpus)-len, "-%d", n);
+    i = n;
+  }
+  logkv(LOG_INFO, "event=placement user=%s policy=%s cpus=%s node=%d",
+        pw->pw_name, os_placement, cpus, node);
+}
+#endif
+
 int os_session_post_session(struct passwd* pw
 #if HAVE_LOGIN_CAP
     , login_cap_t* login_class
@@ -152,11 +337,11 @@ int os_session_post_session(struct passwd* pw
   if (pid < 0) perror_fatal("getprojid()");
   struct project proj, *pproj = getprojbyid(pid, &proj, cbuf, sizeof(cbuf));
   if (!pproj) {
-    perror("Current project not in database. getprojbyid()");
+    log_perror("Current project not in database. getprojbyid()");
     return -1;
   }
   if (!inproj(pw->pw_name, proj.pj_name, pbuf, sizeof(pbuf))) {
-    fprintf(stderr, "User is not in the current project.\n");
+    logmsg(LOG_ERR, "User is not in the current project.");
     return -1;
   }
 #endif
@@ -166,10 +351,15 @@ int os_session_post_session(struct passwd* pw
                      LOGIN_SETRESOURCES|LOGIN_SETPRIORITY|
                      LOGIN_SETMAC|LOGIN_SETCPUMASK) < 0)
   {
-    perror("setusercontext(limits) failed");
+    log_perror("setusercontext(limits) failed");
     return -1;
   }
 #endif
 
+  /* Linux */
+#ifdef __linux
+  if (os_placement) place_session(pw);
+#endif
+
   return 0;
 }
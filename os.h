@@ -29,6 +29,13 @@ struct passwd;
 #include <login_cap.h>
 #endif
 
+/* Where to run sessions on Linux: "cpu[:N]" or "node" to deal them out
+ * round robin over groups of N CPUs (4 by default) or the NUMA nodes we may
+ * use, or else a file mapping users and groups to CPUs. os_session_seq
+ * numbers the session for the deal. */
+extern const char* os_placement;
+extern unsigned os_session_seq;
+
 void os_daemon_post_fork();
 void os_session_post_auth(char* username, uid_t uid);
 int os_session_post_session(struct passwd* pw
@@ -19,6 +19,7 @@
 
 #include "pam.h"
 #include "util.h"
+#include "log.h"
 #include "net.h"
 
 #include <stdlib.h>
@@ -143,31 +144,29 @@ bail:
 
 PAM_CONST struct pam_conv conv = { &conv_fn, 0 };
 
-int pam_authenticate_session(char** username, int fd)
+static void start_(const char* username)
 {
   int rv;
-  if ((rv = pam_start(PAM_APPL_NAME, *username, &conv, &pam_h)) != PAM_SUCCESS)
+  if ((rv = pam_start(PAM_APPL_NAME, username, &conv, &pam_h)) != PAM_SUCCESS)
     fatal("pam_start() failure: %d", rv);
 #ifdef SUN_PAM_TTY_BUG
   if ((rv = pam_set_item(pam_h, PAM_TTY, "/dev/nld")) != PAM_SUCCESS)
     fatal("pam_set_item(PAM_TTY,/dev/nld");
 #endif
+}
 
-  pam_conv_fd = fd;
-  if ((rv = pam_authenticate(pam_h, 0)) != PAM_SUCCESS) {
-    debug("pam_authenticate(): %s", pam_strerror(pam_h, rv));
-    pam_conv_fd = -1;
-    return -1;
-  }
-
-  rv = pam_acct_mgmt(pam_h, 0);
+/* pam_acct_mgmt(), and the password change it may ask for, talking to the
+ * client over pam_conv_fd. */
+static int account_(char** username)
+{
+  int rv = pam_acct_mgmt(pam_h, 0), item_rv;
 
   char* pam_user = 0;
-  if ((rv = pam_get_item(pam_h, PAM_USER, (PAM_CONST void**)&pam_user)) !=
-               PAM_SUCCESS)
+  if ((item_rv = pam_get_item(pam_h, PAM_USER,
+                              (PAM_CONST void**)&pam_user)) != PAM_SUCCESS)
   {
     pam_user = 0;
-    debug("pam_get_item(PAM_USER): %s", pam_strerror(pam_h, rv));
+    debug("pam_get_item(PAM_USER): %s", pam_strerror(pam_h, item_rv));
   } else if (!(pam_user = strdup(pam_user))) fatal("malloc()");
   else {
     free(*username);
@@ -183,7 +182,7 @@ int pam_authenticate_session(char** username, int fd)
     if (!pwp) {
       if (rv) {
         errno = rv;
-        perror("Fetching user for pam_chauthtok failed. getpwnam_r()");
+        log_perror("Fetching user for pam_chauthtok failed. getpwnam_r()");
       } else debug("Fetching user for pam_chauthtok failed: not found");
       pam_conv_fd = -1;
       return -1;
@@ -208,7 +207,31 @@ int pam_authenticate_session(char** username, int fd)
     return -1;
   }
   pam_conv_fd = -1;
+  return 0;
+}
+
+int pam_authenticate_session(char** username, int fd)
+{
+  int rv;
+  start_(*username);
+  pam_conv_fd = fd;
+  if ((rv = pam_authenticate(pam_h, 0)) != PAM_SUCCESS) {
+    debug("pam_authenticate(): %s", pam_strerror(pam_h, rv));
+    pam_conv_fd = -1;
+    return -1;
+  }
+  if (account_(username) < 0) return -1;
+  authenticated = 1;
+  return 0;
+}
 
+int pam_account_session(char** username, int fd)
+{
+  start_(*username);
+  pam_conv_fd = fd;
+  if (account_(username) < 0) return -1;
+  /* The peer's credentials stand in for pam_authenticate, so setcred and
+   * open_session failures are as fatal as after a password. */
   authenticated = 1;
   return 0;
 }
@@ -216,13 +239,7 @@ int pam_authenticate_session(char** username, int fd)
 int pam_begin_session(const char* username, int fd)
 {
   int rv, i;
-  if (!pam_h &&
-      (rv = pam_start(PAM_APPL_NAME, username, &conv, &pam_h)) != PAM_SUCCESS)
-    fatal("pam_start() failure: %d", rv);
-#ifdef SUN_PAM_TTY_BUG
-  if ((rv = pam_set_item(pam_h, PAM_TTY, "/dev/nld")) != PAM_SUCCESS)
-    fatal("pam_set_item(PAM_TTY,/dev/nld");
-#endif
+  if (!pam_h) start_(username);
 
   conv_reject_prompts = 1;
   pam_conv_fd = fd;
@@ -306,13 +323,14 @@ void pam_cleanup(uid_t uid)
      *     Maybe the keyserver is down?
      * I think these are benign. */
     if (setreuid(-1,uid) < 0)
-      perror("PAM_DELETE_CRED workaround failed. setreuid()");
+      log_perror("PAM_DELETE_CRED workaround failed. setreuid()");
 #endif
     if ((rv = pam_setcred(pam_h, PAM_DELETE_CRED)) != PAM_SUCCESS)
       debug("pam_setcred(PAM_DELETE_CRED): %s", pam_strerror(pam_h, rv));
 #ifdef SUN_RPC_PAM_BUG
     if (setreuid(-1,0) < 0)
-      perror("PAM_DELETE_CRED workaround: restering root failed. setreuid()");
+      log_perror("PAM_DELETE_CRED workaround: restering root failed. "
+                 "setreuid()");
 #endif
   }
   if (opened_session) {
@@ -27,6 +27,9 @@
 #define PAM_APPL_NAME "netlogind"
 
 int pam_authenticate_session(char** username, int fd);
+/* The account checks alone, for a client whose credentials the kernel has
+ * already vouched for. */
+int pam_account_session(char** username, int fd);
 int pam_begin_session(const char* username, int fd);
 void pam_export_environ();
 void pam_cleanup(uid_t uid);
@@ -0,0 +1,262 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#include "record.h"
+#include "util.h"
+#include "log.h"
+#include "net.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+
+/* No frame we'd send or accept comes near this. */
+#define RECORD_FRAME_MAX (1 << 30)
+
+static int get_uint_(const char* p)
+{
+  unsigned int u;
+  memcpy(&u, p, sizeof(u));
+  u = ntohl(u);
+  return u > INT_MAX ? -1 : (int)u;
+}
+
+int frame_parse(const char* buf, int len, struct frame* f)
+{
+  int off = 0, fixed, str = 1, n;
+  f->channel = f->job = -1;
+  while (1) {
+    if (len - off < 4) return 0;
+    f->msg = get_uint_(buf + off);
+    off += 4;
+    if (f->msg != MSG_CHANNEL && f->msg != MSG_JOB) break;
+    if (len - off < 4) return 0;
+    if (f->msg == MSG_CHANNEL) f->channel = get_uint_(buf + off);
+    else f->job = get_uint_(buf + off);
+    off += 4;
+    if (off > 16) return -1; /* a job's tag goes inside a channel's, once */
+  }
+  /* The same layouts as msg_buf_read(). */
+  switch (f->msg) {
+  case MSG_FINISH: case MSG_PROMPT: case MSG_OPEN: case MSG_MAXFRAME:
+  case MSG_WINDOW: case MSG_COMPRESS: case MSG_EXIT:
+    fixed = 4; str = 0; break;
+  case MSG_PTY: case MSG_WINCH: fixed = 8; str = 0; break;
+  case MSG_PROGRESS: fixed = 16; str = 0; break;
+  case MSG_ZFRAME: fixed = 4; break;
+  case MSG_GET: fixed = 8; break;
+  case MSG_PUT: fixed = 16; break;
+  case MSG_TEXT: case MSG_REPLY: case MSG_RESUME: case MSG_TICKET:
+  case MSG_DATA:
+    fixed = 0; break;
+  default:
+    return -1;
+  }
+  if (len - off < fixed + 4*str) return 0;
+  f->arg = fixed ? get_uint_(buf + off) : -1;
+  off += fixed;
+  if (str) {
+    if ((n = get_uint_(buf + off)) < 0 || n > RECORD_FRAME_MAX) return -1;
+    off += 4;
+  } else {
+    n = 0;
+  }
+  f->header = off;
+  f->len = off + n;
+  return 1;
+}
+
+
+/*
+ * Recording. Each direction is split into frames as it passes; a server
+ * frame's payload is skipped over rather than buffered.
+ */
+struct stream {
+  char* buf;
+  int len, cap, skip;
+};
+static struct stream streams[2];
+static FILE* record_file = 0;
+static struct timeval record_last;
+static int record_secret = 0; /* the last prompt doesn't echo */
+
+static void put_uint_(unsigned int u)
+{
+  u = htonl(u);
+  (void)fwrite(&u, sizeof(u), 1, record_file);
+}
+
+static void record_frame(int flags, const struct frame* f, const char* buf,
+                         int kept)
+{
+  struct timeval now;
+  double usec;
+  gettimeofday(&now, 0);
+  usec = (now.tv_sec - record_last.tv_sec) * 1e6 +
+         (now.tv_usec - record_last.tv_usec);
+  record_last = now;
+  (void)fputc(flags, record_file);
+  put_uint_(usec < 0 ? 0 : usec > 4e9 ? 4000000000u : (unsigned int)usec);
+  put_uint_(f->len);
+  put_uint_(kept);
+  (void)fwrite(buf, 1, kept, record_file);
+}
+
+static void record_stop()
+{
+  int i;
+  if (!record_file) return;
+  if (fclose(record_file) != 0) log_perror("record: fclose()");
+  record_file = 0;
+  for (i = 0; i < 2; ++i) {
+    buffer_scrub(streams[i].buf, streams[i].cap);
+    free(streams[i].buf);
+  }
+}
+
+static void record_tap(int out, const void* buf, int len)
+{
+  struct stream* s = &streams[out];
+  const char* p = buf;
+  struct frame f;
+  int rv, used;
+  if (!record_file) return;
+  if (s->skip) {
+    used = len < s->skip ? len : s->skip;
+    s->skip -= used;
+    p += used;
+    len -= used;
+  }
+  if (s->len + len > s->cap) {
+    int cap = s->cap ? s->cap : 256;
+    char* grown;
+    while (cap < s->len + len) cap *= 2;
+    if (!(grown = malloc(cap))) fatal("malloc()");
+    memcpy(grown, s->buf, s->len);
+    buffer_scrub(s->buf, s->cap);
+    free(s->buf);
+    s->buf = grown;
+    s->cap = cap;
+  }
+  memcpy(s->buf + s->len, p, len);
+  s->len += len;
+
+  while ((rv = frame_parse(s->buf, s->len, &f)) > 0) {
+    int elide = !out && f.header < f.len;
+    if (!elide && s->len < f.len) break;
+    if (!out) {
+      if (f.msg == MSG_PROMPT) record_secret = !f.arg;
+      record_frame(RECORD_SERVER | (elide ? RECORD_ELIDED : 0), &f, s->buf,
+                   f.header);
+    } else if (f.msg == MSG_RESUME ||
+               (f.msg == MSG_REPLY && record_secret)) {
+      /* Say it's empty: replayed, it's as if the user just hit return. */
+      struct frame cut = f;
+      cut.len = f.header;
+      memset(s->buf + f.header - 4, 0, 4);
+      record_frame(RECORD_REDACTED, &cut, s->buf, f.header);
+    } else {
+      record_frame(0, &f, s->buf, f.len);
+    }
+    used = f.len < s->len ? f.len : s->len;
+    s->skip = f.len - used;
+    buffer_scrub(s->buf, used);
+    memmove(s->buf, s->buf + used, s->len - used);
+    s->len -= used;
+  }
+  if (rv < 0) {
+    logmsg(LOG_ERR, "record: unknown message id %d; stopping", f.msg);
+    record_stop();
+  }
+}
+
+int record_start(int fd, const char* path)
+{
+  if (!(record_file = fopen(path, "w"))) {
+    log_perror(path);
+    return -1;
+  }
+  (void)fputs(RECORD_MAGIC, record_file);
+  gettimeofday(&record_last, 0);
+  net_set_tap(fd, record_tap);
+  atexit(record_stop);
+  return 0;
+}
+
+
+static int read_uint_(FILE* f, unsigned int* u)
+{
+  if (fread(u, sizeof(*u), 1, f) != 1) return -1;
+  *u = ntohl(*u);
+  return 0;
+}
+
+struct record* record_load(const char* path, int* n)
+{
+  char magic[sizeof(RECORD_MAGIC) - 1];
+  struct record* recs = 0;
+  int size = 0, c;
+  unsigned int len, kept, usec;
+  FILE* f = fopen(path, "r");
+  *n = 0;
+  if (!f) { log_perror(path); return 0; }
+  if (fread(magic, sizeof(magic), 1, f) != 1 ||
+      memcmp(magic, RECORD_MAGIC, sizeof(magic))) {
+    logmsg(LOG_ERR, "%s: not a transcript", path);
+    goto fail;
+  }
+  while ((c = fgetc(f)) != EOF) {
+    struct record* r;
+    if (read_uint_(f, &usec) < 0 || read_uint_(f, &len) < 0 ||
+        read_uint_(f, &kept) < 0 || kept > len || len > RECORD_FRAME_MAX) {
+      logmsg(LOG_ERR, "%s: truncated at frame %d", path, *n);
+      goto fail;
+    }
+    if (*n == size) {
+      size = size ? 2*size : 64;
+      if (!(r = realloc(recs, size * sizeof(*recs)))) fatal("malloc()");
+      recs = r;
+    }
+    r = &recs[*n];
+    r->flags = c;
+    r->usec = usec;
+    r->len = len;
+    r->kept = kept;
+    if (!(r->buf = malloc(kept ? kept : 1))) fatal("malloc()");
+    if (fread(r->buf, 1, kept, f) != kept) {
+      free(r->buf);
+      logmsg(LOG_ERR, "%s: truncated at frame %d", path, *n);
+      goto fail;
+    }
+    ++*n;
+  }
+  (void)fclose(f);
+  if (!*n) logmsg(LOG_ERR, "%s: no frames", path);
+  return recs;
+ fail:
+  while (*n) free(recs[--*n].buf);
+  free(recs);
+  (void)fclose(f);
+  return 0;
+}
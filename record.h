@@ -0,0 +1,73 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef RECORD_H__
+#define RECORD_H__
+
+/*
+ * Protocol transcripts. With -record FILE, the client taps its connection
+ * (see net_set_tap()) and writes each frame that passes, in either
+ * direction, to FILE, with the time since the one before. netreplay reads
+ * them back, to drive a daemon with the same conversation as fast as it
+ * will go, or at some multiple of the speed it was recorded at.
+ *
+ * A transcript is the magic below, then for each frame: a flags byte, the
+ * microseconds since the previous frame, the frame's length on the wire,
+ * and the number of its bytes kept, all as uints; then the bytes kept.
+ * The client's frames are kept whole, except for the payload of a REPLY to
+ * a prompt that doesn't echo, or of a RESUME, which are cut to nothing so
+ * that no password or ticket reaches the file (though what's typed at a
+ * -pty command is kept, since there's no telling what's a password there).
+ * Only the headers of the server's frames are kept; replay needs their type
+ * and tags, not output.
+ */
+#define RECORD_MAGIC "NLTR1\n"
+#define RECORD_SERVER   0x1 /* sent by the server, not the client */
+#define RECORD_ELIDED   0x2 /* payload not kept */
+#define RECORD_REDACTED 0x4 /* payload cut out, and its length set to 0 */
+
+/* The shape of one frame at the start of a buffer: the message id under
+ * any channel and job tags (-1 if untagged), its first uint, if it has
+ * one, the length of everything up to any string payload, and of the whole
+ * frame. */
+struct frame {
+  int msg, channel, job, arg, header, len;
+};
+
+/* Returns 1 with f filled in once the frame's header is in the buffer
+ * (though perhaps not all of its payload), 0 if more is needed, or -1 if
+ * it's no frame we know. */
+int frame_parse(const char* buf, int len, struct frame* f);
+
+/* Start recording the connection on fd to path; the file is completed when
+ * the process exits. */
+int record_start(int fd, const char* path);
+
+struct record {
+  int flags, len, kept;
+  unsigned usec;
+  char* buf;
+};
+
+/* Read a whole transcript, returning its frames and their count in *n, or
+ * 0 (with a message logged). */
+struct record* record_load(const char* path, int* n);
+
+#endif
@@ -17,15 +17,33 @@
   SOFTWARE.
  */
 
+#ifdef __linux
+#define _GNU_SOURCE /* for posix_openpt, sched_getaffinity */
+#endif
+
 #include <config.h>
 #include "session.h"
 #include "util.h"
+#include "log.h"
 #include "net.h"
 #include "os.h"
 #include "pam.h"
+#include "xfer.h"
+#include "compress.h"
+#include "cgroup.h"
+#include "acct.h"
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#ifdef __linux
+#include <sched.h>
+#endif
+#include <fcntl.h>
 #include <unistd.h>
 #include <grp.h>
 #include <pwd.h>
@@ -36,6 +54,7 @@ extern char** environ;
 #include <errno.h>
 #include <signal.h>
 #include <assert.h>
+#include <time.h>
 
 #if HAVE_LOGIN_CAP
 #include <login_cap.h>
@@ -54,16 +73,100 @@ int perform_authentication = 0;
 int perform_authentication = 1;
 #endif
 
+/* With peer_authentication, a client on the UNIX socket that is already
+ * running as the user it asks for is let in without a password, though PAM
+ * still checks the account and sets up the session. */
+int peer_authentication = 0;
+static int peer_authenticated = 0;
+
+/* Resumption is opt-in: when resume_grace is set, a session that finishes
+ * hands the client a ticket and waits that many seconds for a new connection
+ * to present it. session_peer_uid is the uid of the client process, when the
+ * transport can tell us. */
+#define RESUME_DIR "/var/run"
+int resume_grace = 0;
+
+/* The client's answer to the username prompt, which the listener collects
+ * before it creates any processes for the connection: a MSG_REPLY with the
+ * username, or a MSG_RESUME with a ticket. */
+int login_msg = 0;
+char* login_reply = 0;
+uid_t session_peer_uid = (uid_t)-1;
+int session_peer_known = 0;
+
+#define MAX_CHANNELS 16
+#define MAX_COMMANDS 64
+
+/* Output from a pty is gathered for up to PTY_LATENCY ms, or until there's
+ * PTY_FRAME bytes of it, so that a redrawing screen doesn't cost a frame per
+ * write the program makes. */
+#define PTY_LATENCY 5
+#define PTY_FRAME (16*1024)
+
+/* Command loop state: which channels are open and waiting for a command,
+ * and which commands' output we are still relaying. The latest command on
+ * each channel reads the client's MSG_DATA from in_fd; whatever the pipe
+ * won't take yet waits in in_buf, which the client's window keeps to
+ * flow_window bytes, and EOF waits behind it. in_acked counts the bytes
+ * gone from in_buf that we've yet to grant back. out_credit is what the
+ * client has granted us for the channel's output; its commands aren't read
+ * while it's spent. While the latest job, in_job, is still queued, in_held
+ * is set and its input waits in in_buf for it to start. A channel given over
+ * to a file transfer has it in xfer until it's done. */
+static struct {
+  int open, prompted;
+  int in_fd, in_len, in_off;
+  char* in_buf;
+  int in_granted, in_acked, in_eof, out_credit;
+  int pty_rows, pty_cols, in_pty, in_job, in_held;
+  struct xfer xfer;
+} channels[MAX_CHANNELS];
+/* A job is done once its process has exited and its output reached EOF,
+ * in either order; until then it keeps its place in commands[]. Jobs over
+ * the max_jobs limit wait in queued[], in order. */
+#define MAX_QUEUED 256
+static struct {
+  pid_t pid;
+  int out_fd, channel, pty_in, job, exited, status;
+  char* pty_buf;
+  int pty_len;
+  long long flush_at;
+} commands[MAX_COMMANDS];
+static int n_commands = 0;
+static struct {
+  char* command;
+  int channel, job, pty_rows, pty_cols;
+} queued[MAX_QUEUED];
+static int n_queued = 0, next_job = 0;
+int max_jobs = 0; /* 0 for one per CPU the session may use */
+
+/* SIGCHLD wakes the command loop through this pipe. */
+static int chld_pipe[2] = { -1, -1 };
+static void chldHandler(int s)
+{
+  int saved_errno = errno;
+  ssize_t rv = write(chld_pipe[1], "", 1); /* if it's full, it's pending */
+  (void)rv;
+  errno = saved_errno;
+}
+
 static int got_alarm = 0;
 static void alarmHandler(int s)
 { if (s == SIGALRM) got_alarm = 1; }
 
+/* Set in the child that serves the client's commands as the user (see
+ * serve_commands()); the session it was forked from cleans up after it. */
+static int as_user = 0;
+
 void session_cleanup()
 {
   int err, status;
+  acct_logout();
+  cgroup_finish(username);
   free(username); username = 0;
 
-  if (session_fd >= 0 && close(session_fd) < 0) perror("close(session_fd)");
+  if (session_fd >= 0 && close(session_fd) < 0)
+    log_perror("close(session_fd)");
   session_fd = -1;
 
 #if HAVE_LOGIN_CAP
@@ -86,20 +189,20 @@ void session_cleanup()
          errno == EINTR && !got_alarm)
     ;
   if (err < 0 && errno == EINTR) debug("Abandoned session child");
-  if (err < 0) perror("waitpid(session_pid)");
+  if (err < 0) log_perror("waitpid(session_pid)");
   else if (WIFEXITED(status) && WEXITSTATUS(status))
-    fprintf(stderr, "Session child exited abnormally: code %d\n",
-                    WEXITSTATUS(status));
+    logmsg(LOG_ERR, "Session child exited abnormally: code %d",
+           WEXITSTATUS(status));
   else if (WIFSIGNALED(status))
-    psignal(WTERMSIG(status), "Session child termined");
+    logmsg(LOG_ERR, "Session child terminated: signal %d", WTERMSIG(status));
   alarm(0);
   signal(SIGALRM, SIG_DFL);
   session_pid = (pid_t)-1;
 }
 
-static void session_fatal(const char* fmt, ...)
+static NORETURN void session_fatal(const char* fmt, ...)
 {
-  session_cleanup();
+  if (!as_user) session_cleanup();
   if (!fmt) exit(1);
   va_list ap;
   va_start(ap, fmt);
@@ -133,26 +236,842 @@ static void session_environ()
   if (setusercontext(login_class, &pw, pw.pw_uid,
                      LOGIN_SETUMASK|LOGIN_SETPATH|LOGIN_SETENV|
                      LOGIN_SETRESOURCES|LOGIN_SETCPUMASK) < 0)
-    perror("setusercontext(env) failed");
+    log_perror("setusercontext(env) failed");
   login_close(login_class); login_class = 0;
 #endif
 
-  if (chdir(getenv("HOME")) < 0) perror("chdir($HOME)");
+  if (chdir(getenv("HOME")) < 0) log_perror("chdir($HOME)");
+}
+
+static void finish_job(int i)
+{
+  logkv(LOG_INFO, "event=exit user=%s job=%d status=%d", username,
+        commands[i].job, commands[i].status);
+  if (write_exit(session_fd, commands[i].channel, commands[i].job,
+                 commands[i].status) < 0)
+    session_fatal("Unexpected disconnection");
+  commands[i] = commands[--n_commands];
+}
+
+static void reap_children()
+{
+  char buf[64];
+  int status, i;
+  while (chld_pipe[0] >= 0 && read(chld_pipe[0], buf, sizeof(buf)) > 0)
+    ;
+  while(1) {
+    int rv = waitpid(-1, &status, WNOHANG);
+    if (rv == 0 || (rv < 0 && errno == ECHILD)) break;
+    if (rv < 0) {
+      log_perror("waitpid()");
+      (void)write_finish(session_fd, 1);
+      session_fatal(0);
+    }
+    for (i = 0; i < n_commands; ++i) {
+      if (commands[i].pid != rv) continue;
+      commands[i].exited = 1;
+      commands[i].status = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                               : WEXITSTATUS(status);
+    }
+  }
+  /* Backwards, since finishing a job moves the last one into its place. */
+  for (i = n_commands; i > 0; --i)
+    if (commands[i-1].exited && commands[i-1].out_fd < 0) finish_job(i-1);
+}
+
+/* Hand back credit for input we're done with, once there's enough of it to
+ * be worth a message. */
+static void ack_stdin(int channel, int len)
+{
+  channels[channel].in_acked += len;
+  if (channels[channel].in_acked < flow_window / 2) return;
+  if (write_window(session_fd, channel, channels[channel].in_acked) < 0)
+    session_fatal("Unexpected disconnection");
+  channels[channel].in_granted += channels[channel].in_acked;
+  channels[channel].in_acked = 0;
+}
+
+/* Give the command on a channel EOF, discarding anything not yet written. */
+static void close_stdin(int channel)
+{
+  channels[channel].in_eof = channels[channel].in_held = 0;
+  if (channels[channel].in_fd >= 0) (void)close(channels[channel].in_fd);
+  channels[channel].in_fd = -1;
+  if (channels[channel].in_buf) {
+    free(channels[channel].in_buf);
+    channels[channel].in_buf = 0;
+    ack_stdin(channel, channels[channel].in_len - channels[channel].in_off);
+  }
+}
+
+/* Give it EOF once what's pending is written. */
+static void end_stdin(int channel)
+{
+  if (channels[channel].in_buf || channels[channel].in_held)
+    channels[channel].in_eof = 1;
+  else close_stdin(channel);
+}
+
+/* Write as much of a channel's pending input as the pipe will take. */
+static void flush_stdin(int channel)
+{
+  while (channels[channel].in_off < channels[channel].in_len) {
+    ssize_t n = write(channels[channel].in_fd,
+                      channels[channel].in_buf + channels[channel].in_off,
+                      channels[channel].in_len - channels[channel].in_off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN) return;
+    if (n < 0) { close_stdin(channel); return; } /* EPIPE: it's not reading */
+    channels[channel].in_off += n;
+    ack_stdin(channel, n);
+  }
+  free(channels[channel].in_buf);
+  channels[channel].in_buf = 0;
+  if (channels[channel].in_eof) close_stdin(channel);
+}
+
+/* Input for a command, as MSG_DATA or, compressed, as MSG_ZFRAME. */
+static void read_stdin(int channel, int zframe)
+{
+  int len, msg = MSG_DATA;
+  char* data = zframe ? read_zframe(session_fd, &msg, &len)
+                      : read_strn(session_fd, &len);
+  if (!data) session_fatal("Unexpected disconnection");
+  if (msg != MSG_DATA) session_fatal("Bad message id %d", msg);
+  if (channel >= MAX_CHANNELS) {
+    free(data);
+    return;
+  }
+  if (len > channels[channel].in_granted)
+    session_fatal("Input overran the window on channel %d", channel);
+  channels[channel].in_granted -= len;
+  if (channels[channel].in_fd < 0 && !channels[channel].in_held) {
+    free(data);
+    ack_stdin(channel, len);
+    return;
+  }
+  /* Closing our end of a pty wouldn't be seen by the command; send it the
+   * EOF character instead, as typing it would. It was never the client's to
+   * spend, so it mustn't be granted back. */
+  if (!len && channels[channel].in_pty) {
+    data[0] = 4; /* ^D */
+    len = 1;
+    --channels[channel].in_acked;
+  }
+  if (!len) {
+    free(data);
+    end_stdin(channel);
+    return;
+  }
+  if (!channels[channel].in_buf) {
+    /* The window bounds what can be waiting; ^D may take one byte more. */
+    if (!(channels[channel].in_buf = malloc(flow_window + 1)))
+      session_fatal("malloc()");
+    channels[channel].in_len = channels[channel].in_off = 0;
+  } else if (channels[channel].in_off) {
+    channels[channel].in_len -= channels[channel].in_off;
+    memmove(channels[channel].in_buf,
+            channels[channel].in_buf + channels[channel].in_off,
+            channels[channel].in_len);
+    channels[channel].in_off = 0;
+  }
+  memcpy(channels[channel].in_buf + channels[channel].in_len, data, len);
+  channels[channel].in_len += len;
+  free(data);
+  if (channels[channel].in_fd >= 0) flush_stdin(channel);
+}
+
+/* Output for the client on a channel, which the caller has paid for from
+ * the channel's window. */
+static void send_output(int channel, int job, const char* buf, int len)
+{
+  if (write_bulk(session_fd, channel, job, MSG_TEXT, buf, len) < 0)
+    session_fatal("Unexpected disconnection");
+}
+
+/* Our own messages go out regardless, overdrawing the window if need be. */
+static void send_notice(int channel, const char* str)
+{
+  channels[channel].out_credit -= strlen(str);
+  send_output(channel, -1, str, strlen(str));
+}
+
+static long long now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* A pty master, with its slave's name in slave. */
+static int open_pty(char* slave, size_t len)
+{
+#if HAVE_POSIX_OPENPT
+  const char* name;
+  int fd = posix_openpt(O_RDWR|O_NOCTTY);
+  if (fd < 0) return -1;
+  if (grantpt(fd) < 0 || unlockpt(fd) < 0 || !(name = ptsname(fd))) {
+    (void)close(fd);
+    return -1;
+  }
+  strlcpy(slave, name, len);
+  return fd;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void set_winsize(int fd, int rows, int cols)
+{
+  struct winsize ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_row = rows;
+  ws.ws_col = cols;
+  if (ioctl(fd, TIOCSWINSZ, &ws) < 0) log_perror("ioctl(TIOCSWINSZ)");
+}
+
+/* Start a job, on a pty if it asked for one. Returns -1 if it can't be run
+ * at all. */
+static int spawn_command(const char* command, int channel, int job,
+                         int pty_rows, int pty_cols)
+{
+  int out[2], in[2], pty = -1;
+  char slave[128];
+  /* A pty stands in for both pipes; the master's dup is the input side. */
+  if (pty_rows) {
+    pty = open_pty(slave, sizeof(slave));
+    if (pty < 0) {
+      log_perror("open_pty()");
+      send_notice(channel, "Could not allocate a pty\n");
+      return -1;
+    }
+    set_winsize(pty, pty_rows, pty_cols);
+    out[0] = pty;
+    out[1] = in[0] = -1;
+    if ((in[1] = dup(pty)) < 0) {
+      log_perror("dup()");
+      (void)write_finish(session_fd, 1);
+      session_fatal(0);
+    }
+  } else if (pipe(out) < 0 || pipe(in) < 0) {
+    log_perror("pipe()");
+    (void)write_finish(session_fd, 1);
+    session_fatal(0);
+  }
+  /* XXX do strvis(command) */
+  debug("Running command \"%s\" on channel %d", command, channel);
+  logkv(LOG_INFO, "event=command user=%s channel=%d job=%d", username,
+        channel, job);
+  fflush(0);
+  int err = fork();
+  if (err < 0) {
+    log_perror("fork()");
+    (void)write_finish(session_fd, 1);
+    session_fatal(0);
+  }
+  if (err) {
+    if (pty < 0) {
+      (void)close(out[1]);
+      (void)close(in[0]);
+    }
+    /* Input goes to the newest job on the channel, along with whatever
+     * was held for it; a job overtaken while queued gets EOF. */
+    if (job != channels[channel].in_job) {
+      (void)close(in[1]);
+    } else {
+      (void)fcntl(in[1], F_SETFL, O_NONBLOCK);
+      (void)fcntl(in[1], F_SETFD, FD_CLOEXEC);
+      channels[channel].in_fd = in[1];
+      channels[channel].in_held = 0;
+      if (channels[channel].in_eof && !channels[channel].in_buf)
+        close_stdin(channel);
+      /* The client may send input once the first command on the channel is
+       * running; it keeps the same window for any later ones. */
+      if (!channels[channel].in_granted && !channels[channel].in_acked &&
+          !channels[channel].in_buf) {
+        if (write_window(session_fd, channel, flow_window) < 0)
+          session_fatal("Unexpected disconnection");
+        channels[channel].in_granted = flow_window;
+      }
+    }
+    commands[n_commands].pid = err;
+    commands[n_commands].out_fd = out[0];
+    commands[n_commands].channel = channel;
+    commands[n_commands].job = job;
+    commands[n_commands].exited = commands[n_commands].status = 0;
+    commands[n_commands].pty_in =
+      pty >= 0 && job == channels[channel].in_job ? in[1] : -1;
+    commands[n_commands].pty_buf = 0;
+    commands[n_commands].pty_len = 0;
+    if (pty >= 0 && !(commands[n_commands].pty_buf = malloc(PTY_FRAME)))
+      session_fatal("malloc()");
+    ++n_commands;
+    return 0;
+  }
+
+  /* Output goes back to the client on the command's channel, and input
+   * comes from it. With a pty, the command gets a session of its own with
+   * the pty as its controlling terminal. */
+  if (pty >= 0) {
+    if (setsid() < 0) log_perror("setsid()");
+    if ((in[0] = out[1] = open(slave, O_RDWR)) < 0) _exit(1);
+#ifdef TIOCSCTTY
+    (void)ioctl(in[0], TIOCSCTTY, 0);
+#endif
+  }
+  if (dup2(in[0], 0) < 0 || dup2(out[1], 1) < 0 || dup2(out[1], 2) < 0)
+    _exit(1);
+  (void)close(session_fd);
+  log_close();
+  closefrom(3);
+  signal(SIGPIPE, SIG_DFL);
+
+  session_environ();
+  /* We don't perform here pam_end(PAM_DATA_SILENT). On Linux, this tells
+   * the modules only to clean up things local to this process (ie, not
+   * things stored in files. We can't guarantee all modules obey this on
+   * different platforms though, and we're about to `exec`, so it's entirely
+   * fine to leak the process-local things. */
+
+  execlp(command, command, (char*)0);
+  log_perror("execlp()");
+  _exit(127);
+}
+
+/* Run queued jobs, oldest first, while there's room. */
+static void start_jobs()
+{
+  int limit = max_jobs < MAX_COMMANDS ? max_jobs : MAX_COMMANDS;
+  while (n_queued && n_commands < limit) {
+    int channel = queued[0].channel, job = queued[0].job;
+    if (spawn_command(queued[0].command, channel, job, queued[0].pty_rows,
+                      queued[0].pty_cols) < 0) {
+      if (job == channels[channel].in_job) close_stdin(channel);
+      if (write_exit(session_fd, channel, job, 126) < 0)
+        session_fatal("Unexpected disconnection");
+    }
+    free(queued[0].command);
+    memmove(queued, queued+1, --n_queued * sizeof(queued[0]));
+  }
+}
+
+/* Number a command, and queue it to run. */
+static void submit_job(char* command, int channel)
+{
+  int job = ++next_job;
+  if (n_queued == MAX_QUEUED) {
+    send_notice(channel, "Too many jobs queued\n");
+    if (write_exit(session_fd, channel, job, 126) < 0)
+      session_fatal("Unexpected disconnection");
+    free(command);
+    return;
+  }
+  queued[n_queued].command = command;
+  queued[n_queued].channel = channel;
+  queued[n_queued].job = job;
+  queued[n_queued].pty_rows = channels[channel].pty_rows;
+  queued[n_queued].pty_cols = channels[channel].pty_cols;
+  ++n_queued;
+  /* Input is for the newest job on the channel, so any older one gets EOF
+   * now. */
+  close_stdin(channel);
+  channels[channel].in_job = job;
+  channels[channel].in_held = 1;
+  channels[channel].in_pty = channels[channel].pty_rows != 0;
+  channels[channel].pty_rows = 0;
+  start_jobs();
+}
+
+static void flush_pty(int i)
+{
+  if (commands[i].pty_len)
+    send_output(commands[i].channel, commands[i].job, commands[i].pty_buf,
+                commands[i].pty_len);
+  commands[i].pty_len = 0;
+}
+
+/* Forward a chunk of a command's output, or retire it on EOF. Pty output is
+ * held back for a moment, in case more follows. We read no more than the
+ * channel's window allows. */
+static void relay_output(int i)
+{
+  char buf[4096];
+  int channel = commands[i].channel;
+  char* p = commands[i].pty_buf ? commands[i].pty_buf + commands[i].pty_len
+                                : buf;
+  int len = commands[i].pty_buf ? PTY_FRAME - commands[i].pty_len
+                                : (int)sizeof(buf);
+  if (len > channels[channel].out_credit) len = channels[channel].out_credit;
+  ssize_t n = read(commands[i].out_fd, p, len);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+  if (n > 0) channels[channel].out_credit -= n;
+  if (n > 0 && commands[i].pty_buf) {
+    if (!commands[i].pty_len) commands[i].flush_at = now_ms() + PTY_LATENCY;
+    commands[i].pty_len += n;
+    if (commands[i].pty_len == PTY_FRAME || !channels[channel].out_credit)
+      flush_pty(i);
+    return;
+  }
+  if (n > 0) {
+    send_output(channel, commands[i].job, buf, (int)n);
+    return;
+  }
+  /* A pty master reads EIO once the last of the slave is closed. */
+  if (n < 0 && !(commands[i].pty_buf && errno == EIO))
+    log_perror("read(command output)");
+  if (commands[i].pty_buf) {
+    flush_pty(i);
+    free(commands[i].pty_buf);
+    /* Nothing is left reading the pty, so the client can stop sending. */
+    if (channels[channel].in_fd == commands[i].pty_in) {
+      close_stdin(channel);
+      if (write_channel(session_fd, channel) < 0 ||
+          write_data(session_fd, "", 0) < 0)
+        session_fatal("Unexpected disconnection");
+    }
+  }
+  (void)close(commands[i].out_fd);
+  commands[i].out_fd = -1;
+  if (commands[i].exited) finish_job(i);
+}
+
+/* A transfer is over: close its channel. Returns the change in the number
+ * of open channels. */
+static int end_transfer(int channel, int status)
+{
+  if (status < 0) session_fatal("Unexpected disconnection");
+  channels[channel].prompted = channels[channel].open = 0;
+  if (write_channel(session_fd, channel) < 0 ||
+      write_finish(session_fd, status) < 0)
+    session_fatal("Unexpected disconnection");
+  return -1;
+}
+
+/* A file transfer takes the channel over until it is done, then closes it.
+ * Meanwhile the command loop carries on with everything else. */
+static int read_transfer(int msg, int channel)
+{
+  unsigned long long offset, size = 0;
+  char* path;
+  int status;
+  if (read_uint64(session_fd, &offset) < 0 ||
+      (msg == MSG_PUT && read_uint64(session_fd, &size) < 0) ||
+      !(path = read_str(session_fd)))
+    session_fatal("Unexpected disconnection");
+  debug("Transfer of \"%s\" on channel %d", path, channel);
+  channels[channel].prompted = 0;
+  status = xfer_begin(&channels[channel].xfer, session_fd, channel, msg,
+                      username, offset, size, path);
+  return status ? end_transfer(channel, status) : 0;
+}
+
+/* Send the next frame of each get the client has room for. Returns the
+ * change in the number of open channels. */
+static int send_transfers()
+{
+  int i, rv, closed = 0;
+  for (i = 0; i < MAX_CHANNELS; ++i) {
+    struct xfer* x = &channels[i].xfer;
+    if (x->msg != MSG_GET || channels[i].out_credit <= 0) continue;
+    rv = xfer_get_more(x, session_fd, i, &channels[i].out_credit);
+    if (rv < 0) session_fatal("Unexpected disconnection");
+    if (rv) closed += end_transfer(i, xfer_finish(x, session_fd, i));
+  }
+  return closed;
+}
+
+/* Handle one message from the client: a command or input on a channel, a
+ * request to open another channel, or its frame size limit. Returns the
+ * change in the number of open channels. */
+static int read_command()
+{
+  int msg = read_msg_type(session_fd), channel;
+  if (msg != MSG_CHANNEL && msg != MSG_OPEN && msg != MSG_MAXFRAME &&
+      msg != MSG_COMPRESS)
+    session_fatal("Bad message id %d", msg);
+  if ((channel = read_uint(session_fd)) < 0)
+    session_fatal("Unexpected disconnection");
+
+  if (msg == MSG_MAXFRAME) {
+    set_frame_max(&frame_max.send, channel);
+    return 0;
+  }
+
+  /* Agree to compression at the client's level, up to our own. */
+  if (msg == MSG_COMPRESS) {
+    int level = channel < compress_level ? channel : compress_level;
+    if (compress_active(session_fd))
+      session_fatal("Compression already agreed");
+    if (compress_start(session_fd, level) < 0) level = 0;
+    if (write_compress(session_fd, level) < 0)
+      session_fatal("Unexpected disconnection");
+    if (level) debug("Compressing at level %d", level);
+    return 0;
+  }
+
+  if (msg == MSG_OPEN) {
+    if (channel < MAX_CHANNELS && channels[channel].open)
+      session_fatal("Channel %d already open", channel);
+    if (channel >= MAX_CHANNELS) {
+      if (write_channel(session_fd, channel) < 0 ||
+          write_finish(session_fd, 1) < 0)
+        session_fatal("Unexpected disconnection");
+      return 0;
+    }
+    channels[channel].open = 1;
+    return 1;
+  }
+
+  msg = read_msg_type(session_fd);
+  if ((msg == MSG_DATA || msg == MSG_ZFRAME) && channel < MAX_CHANNELS &&
+      channels[channel].xfer.msg == MSG_PUT) {
+    struct xfer* x = &channels[channel].xfer;
+    int rv = xfer_put_data(x, session_fd, msg == MSG_ZFRAME);
+    if (rv < 0) session_fatal("Unexpected disconnection");
+    return rv ? end_transfer(channel, xfer_finish(x, session_fd, channel)) : 0;
+  }
+  if (msg == MSG_DATA || msg == MSG_ZFRAME) {
+    read_stdin(channel, msg == MSG_ZFRAME);
+    return 0;
+  }
+  if (msg == MSG_WINDOW) {
+    int bytes = read_uint(session_fd);
+    if (bytes < 0) session_fatal("Unexpected disconnection");
+    if (channel < MAX_CHANNELS) channels[channel].out_credit += bytes;
+    return 0;
+  }
+  if (msg == MSG_PTY || msg == MSG_WINCH) {
+    int rows = read_uint(session_fd), cols = read_uint(session_fd);
+    if (rows < 0 || cols < 0) session_fatal("Unexpected disconnection");
+    if (channel >= MAX_CHANNELS || !rows || !cols) return 0;
+    if (msg == MSG_PTY) {
+      /* For the next command run on the channel. */
+      channels[channel].pty_rows = rows;
+      channels[channel].pty_cols = cols;
+    } else if (channels[channel].in_fd >= 0 && channels[channel].in_pty) {
+      set_winsize(channels[channel].in_fd, rows, cols);
+    }
+    return 0;
+  }
+  if ((msg != MSG_REPLY && msg != MSG_GET && msg != MSG_PUT) ||
+      channel >= MAX_CHANNELS || !channels[channel].prompted)
+    session_fatal("Unexpected reply on channel %d", channel);
+  if (msg != MSG_REPLY) return read_transfer(msg, channel);
+  char* command = read_str(session_fd);
+  if (!command) { session_fatal("Unexpected disconnection"); assert(0); }
+  channels[channel].prompted = 0;
+  if (command[0]) {
+    submit_job(command, channel);
+    return 0;
+  }
+  free(command);
+  channels[channel].open = 0;
+  end_stdin(channel);
+  if (write_channel(session_fd, channel) < 0 ||
+      write_finish(session_fd, 0) < 0)
+    session_fatal("Unexpected disconnection");
+  return -1;
+}
+
+/* How many CPUs the session may run on, after any placement. */
+static int cpus_available()
+{
+#ifdef __linux
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) return CPU_COUNT(&set);
+#endif
+  return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/* The command loop prompts on each open channel, runs commands as they come
+ * in, and relays their output, until every channel has been closed and every
+ * command's output has been drained. */
+static void command_loop()
+{
+  struct pollfd fds[MAX_COMMANDS+2+MAX_CHANNELS];
+  int i, n, rv, timeout, open_channels = 1;
+  long long now;
+  /* Children are reaped as they exit, so jobs can report their status. */
+  if (pipe(chld_pipe) < 0) perror_fatal("pipe()");
+  for (i = 0; i < 2; ++i) {
+    if (fcntl(chld_pipe[i], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(chld_pipe[i], F_SETFD, FD_CLOEXEC) < 0)
+      perror_fatal("fcntl()");
+  }
+  signal(SIGCHLD, chldHandler);
+  if (max_jobs <= 0 && (max_jobs = cpus_available()) < 1) max_jobs = 1;
+  for (i = 0; i < MAX_CHANNELS; ++i) {
+    channels[i].in_granted = channels[i].in_acked = channels[i].in_eof = 0;
+    channels[i].out_credit = channels[i].xfer.msg = 0;
+  }
+  channels[0].open = 1;
+
+  while (open_channels || n_commands || n_queued) {
+    start_jobs();
+    for (i = 0; i < MAX_CHANNELS; ++i) {
+      if (!channels[i].open || channels[i].prompted || channels[i].xfer.msg)
+        continue;
+      if (write_channel(session_fd, i) < 0 ||
+          write_prompt(session_fd, 1) < 0)
+        session_fatal("Unexpected disconnection");
+      channels[i].prompted = 1;
+    }
+
+    /* Once the last channel is closed, we just drain output, though we
+     * still need the client's window updates for it. */
+    fds[0].fd = session_fd;
+    fds[0].events = POLLIN;
+    for (i = 0; i < n_commands; ++i) {
+      fds[i+1].fd = channels[commands[i].channel].out_credit > 0 ?
+                    commands[i].out_fd : -1;
+      fds[i+1].events = POLLIN;
+    }
+    n = n_commands+1;
+    for (i = 0; i < MAX_CHANNELS; ++i) {
+      fds[n].fd = channels[i].in_buf ? channels[i].in_fd : -1;
+      fds[n++].events = POLLOUT;
+    }
+    fds[n].fd = chld_pipe[0];
+    fds[n++].events = POLLIN;
+    /* Wake for the earliest pty output that's due, or straight away if a
+     * get has room to send more. */
+    timeout = -1;
+    for (i = 0; i < MAX_CHANNELS; ++i)
+      if (channels[i].xfer.msg == MSG_GET && channels[i].out_credit > 0)
+        timeout = 0;
+    now = now_ms();
+    for (i = 0; i < n_commands; ++i) {
+      if (!commands[i].pty_len) continue;
+      long long left = commands[i].flush_at - now;
+      if (left < 0) left = 0;
+      if (timeout < 0 || left < timeout) timeout = (int)left;
+    }
+    rv = poll(fds, n, timeout);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0) perror_fatal("poll()");
+
+    for (i = 0; i < MAX_CHANNELS; ++i)
+      if (fds[n_commands+1+i].revents) flush_stdin(i);
+    /* Backwards, so retiring a command doesn't disturb the entries left. */
+    for (i = n_commands; i > 0; --i)
+      if (fds[i].revents) relay_output(i-1);
+    now = now_ms();
+    for (i = 0; i < n_commands; ++i)
+      if (commands[i].pty_len && commands[i].flush_at <= now) flush_pty(i);
+    if (fds[0].revents) open_channels += read_command();
+    open_channels += send_transfers();
+    reap_children();
+  }
+}
+
+static void resume_path(char* buf, size_t len, long pid)
+{ snprintf(buf, len, RESUME_DIR "/netlogind.%ld.resume", pid); }
+
+/* A new connection has presented a ticket. The ticket names the session that
+ * issued it; we pass that session our end of the socket to the [net] process
+ * and bow out, leaving it to carry on as if the client had logged in (and so
+ * to take the connection itself from the [net] process). */
+static void session_resume(char* ticket)
+{
+  char path[128], uid[32];
+  int fd, status = -1;
+  long pid = strtol(ticket, 0, 10);
+
+  if (pid > 0 && session_peer_known) {
+    resume_path(path, sizeof(path), pid);
+    snprintf(uid, sizeof(uid), "%lu", (unsigned long)session_peer_uid);
+    if ((fd = un_connect(path)) >= 0) {
+      if (write_str(fd, ticket) == 0 && write_str(fd, uid) == 0 &&
+          send_fd(fd, session_fd) == 0)
+        status = read_uint(fd);
+      (void)close(fd);
+    }
+  }
+  buffer_scrub(ticket, strlen(ticket));
+  free(ticket);
+  if (status != 0) {
+    (void)write_text(session_fd, "Session resumption failed\n");
+    (void)write_finish(session_fd, 1);
+    session_fatal("Session resumption failed");
+  }
+  logkv(LOG_INFO, "event=resumed pid=%ld", pid);
+  exit(0);
+}
+
+static int ticket_matches(const char* a, const char* b)
+{
+  size_t len = strlen(b), i;
+  unsigned char diff = strlen(a) != len;
+  for (i = 0; i < len && a[i]; ++i) diff |= a[i] ^ b[i];
+  return !diff;
+}
+
+/* Wait out the grace period for a connection presenting our ticket. Only
+ * root (another session process) may connect, and it must be relaying for
+ * the same local user as the original connection. */
+static int await_resume(int listen_fd, const char* ticket)
+{
+  time_t deadline = time(0) + resume_grace;
+  while (1) {
+    struct pollfd pfd;
+    int left = (int)(deadline - time(0)), rv, fd, new_fd, ok;
+    uid_t uid;
+    if (left <= 0) return -1;
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    rv = poll(&pfd, 1, left*1000);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0) { log_perror("poll(resume)"); return -1; }
+    if (rv == 0) return -1;
+    if ((fd = accept(listen_fd, 0, 0)) < 0) continue;
+
+    ok = peer_uid(fd, &uid) < 0 ? errno == ENOTSUP : uid == 0;
+    char* presented = read_str(fd);
+    char* client_uid = read_str(fd);
+    new_fd = recv_fd(fd);
+    ok = ok && presented && client_uid && new_fd >= 0 &&
+         ticket_matches(presented, ticket) && session_peer_known &&
+         strtoul(client_uid, 0, 10) == (unsigned long)session_peer_uid;
+    (void)write_uint(fd, ok ? 0 : 1);
+    (void)close(fd);
+    if (presented) { buffer_scrub(presented, strlen(presented)); }
+    free(presented);
+    free(client_uid);
+    if (ok) return new_fd;
+    if (new_fd >= 0) (void)close(new_fd);
+    logkv(LOG_WARNING, "event=resume-rejected");
+  }
+}
+
+/* Issue a ticket, end the current connection, and wait for the client to
+ * come back. Returns the new connection to the [net] process, or -1 if the
+ * grace period expires (or we couldn't offer resumption at all). */
+static int offer_resume()
+{
+  unsigned char secret[16];
+  char ticket[64], path[128];
+  int fd, listen_fd, i;
+
+  if (!session_peer_known) return -1;
+  if ((fd = open("/dev/urandom", O_RDONLY)) < 0) {
+    log_perror("open(/dev/urandom)");
+    return -1;
+  }
+  i = read(fd, secret, sizeof(secret));
+  (void)close(fd);
+  if (i != (int)sizeof(secret)) { log_perror("read(/dev/urandom)"); return -1; }
+  i = snprintf(ticket, sizeof(ticket), "%ld:", (long)getpid());
+  for (fd = 0; fd < (int)sizeof(secret); ++fd)
+    i += snprintf(ticket+i, sizeof(ticket)-i, "%02x", secret[fd]);
+  buffer_scrub(secret, sizeof(secret));
+
+  resume_path(path, sizeof(path), (long)getpid());
+  (void)unlink(path);
+  if ((listen_fd = un_listen(path)) < 0) return -1;
+  if (chmod(path, 0600) < 0) {
+    log_perror("chmod(resume socket)");
+    (void)close(listen_fd);
+    (void)unlink(path);
+    return -1;
+  }
+
+  if (write_ticket(session_fd, ticket) < 0 ||
+      write_finish(session_fd, 0) < 0)
+    session_fatal("Unexpected disconnection");
+  compress_end(session_fd);
+  (void)close(session_fd);
+  session_fd = -1;
+
+  while(1) {
+    int rv = wait(0);
+    if (rv < 0 && errno == ECHILD) break;
+    if (rv < 0 && errno != EINTR) perror_fatal("waitpid()");
+  }
+
+  setproctitle("%s [session] (resumable)", username);
+  fd = await_resume(listen_fd, ticket);
+  buffer_scrub(ticket, sizeof(ticket));
+  (void)close(listen_fd);
+  (void)unlink(path);
+  return fd;
+}
+
+/* Once the [net] process has seen a login through, it passes us the client's
+ * own connection, and we serve the command loop on that directly. */
+static void take_connection()
+{
+  int fd = recv_fd(session_fd);
+  if (fd < 0) session_fatal("Connection not handed over");
+  (void)close(session_fd);
+  session_fd = fd;
+}
+
+/* Serve the client's commands in a child that becomes the user outright, in
+ * the session's cgroup, so that from here on nothing the client sends is
+ * parsed as root. We only wait for it, to clean up once it's done. Returns
+ * its exit status. */
+static int serve_commands()
+{
+  int status;
+  /* Forking as the user, so that its process limits apply to the fork. */
+  if (setreuid(pw.pw_uid, -1) < 0) log_perror("setreuid(pw_uid)");
+  fflush(0);
+  pid_t pid = cgroup_fork();
+  if (pid == 0) {
+    as_user = 1;
+    if (setuid(pw.pw_uid) < 0 || getuid() != pw.pw_uid ||
+        geteuid() != pw.pw_uid)
+      fatal("Could not setuid");
+    if (chdir(pw.pw_dir) < 0) log_perror("chdir(pw_dir)");
+    setproctitle("%s [commands]", username);
+    command_loop();
+    exit(0);
+  }
+  if (setreuid(0, -1) < 0) log_perror("setreuid(root)");
+  if (pid < 0) {
+    log_perror("fork()");
+    return 1;
+  }
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno == EINTR) continue;
+    log_perror("waitpid()");
+    return 1;
+  }
+  if (WIFSIGNALED(status)) {
+    logmsg(LOG_ERR, "Command loop terminated: signal %d", WTERMSIG(status));
+    return 1;
+  }
+  return WEXITSTATUS(status);
 }
 
 /* The protocol the main thread uses to talk to the session is simple: TEXT is
  * sent to the client, PROMPT is sent to the client and REPLY sent back. The
  * first FINISH marks the end of authentication, at which point we send over
- * the username in a TEXT message. If the status is 0, we enter the command
- * loop and again relay prompts to the client in the main thread. */
+ * the username in a REPLY message. If the status is 0, the main thread hands
+ * us the client's connection (see take_connection()) and exits. We never
+ * read from it again ourselves: serve_commands() does, as the user. */
+#if HAVE_PAM
+/* Whether the client process runs as the user it wants to log in as, going
+ * by the credentials the kernel gave us for the socket. */
+static int peer_is_user(const char* name)
+{
+  struct passwd ent, *entp;
+  char ent_buf[1024];
+  if (!session_peer_known) return 0;
+  if (getpwnam_r(name, &ent, ent_buf, sizeof(ent_buf), &entp) != 0 || !entp)
+    return 0;
+  return entp->pw_uid == session_peer_uid;
+}
+#endif
+
 int session_main()
 {
-  int rv;
+  int rv, i;
   setproctitle("[session]");
-  if (write_text(session_fd, "Username: ") < 0 ||
-      write_prompt(session_fd, 1) < 0)
-    session_fatal("Unexpected disconnection");
-  username = read_reply(session_fd);
+  if (login_msg == MSG_RESUME && resume_grace) session_resume(login_reply);
+  username = login_msg == MSG_REPLY ? login_reply : 0;
+  login_reply = 0;
   if (!username || !username[0]) session_fatal("No username returned");
 
 #if !HAVE_PAM
@@ -163,7 +1082,13 @@ int session_main()
       session_fatal("Unexpected disconnection");
   }
 #if HAVE_PAM
-  else {
+  else if (peer_authentication && peer_is_user(username)) {
+    peer_authenticated = 1;
+    if (pam_account_session(&username, session_fd) < 0) {
+      (void)write_finish(session_fd, 1);
+      session_fatal("Account check failed");
+    }
+  } else {
     if (pam_authenticate_session(&username, session_fd) < 0) {
       (void)write_finish(session_fd, 1);
       session_fatal("Authentication failed");
@@ -178,15 +1103,20 @@ int session_main()
     struct passwd null = {0,};
     pw = null;
     (void)write_finish(session_fd, 1);
-    if (rv) { errno = rv; perror("getpwnam_r()"); }
+    if (rv) { errno = rv; log_perror("getpwnam_r()"); }
     session_fatal(rv ? "Fetching username failed" :
                        "No matching passwd entry");
   }
+  /* PAM may have given us a different user to the one we checked. */
+  if (peer_authenticated && pw.pw_uid != session_peer_uid) {
+    (void)write_finish(session_fd, 1);
+    session_fatal("Peer credentials don't match %s", username);
+  }
 
 #if HAVE_LOGIN_CAP
   login_class = login_getpwclass(&pw);
   if (!login_class) {
-    perror("login_getpwclass()");
+    log_perror("login_getpwclass()");
     (void)write_finish(session_fd, 1);
     session_fatal("Login class not found");
   }
@@ -223,65 +1153,45 @@ int session_main()
     (void)write_finish(session_fd, 1);
     session_fatal("Session creation failed");
   }
+  if (cgroup_create() < 0) {
+    (void)write_finish(session_fd, 1);
+    session_fatal("Session cgroup creation failed");
+  }
 
+  log_set_phase("session");
+  logkv(LOG_INFO, "event=login user=%s uid=%lu%s", username,
+        (unsigned long)pw.pw_uid, peer_authenticated ? " auth=peer" : "");
   setproctitle("%s [session]", username);
   if (write_finish(session_fd, 0) < 0 ||
       write_reply(session_fd, username) < 0)
     session_fatal("Unexpected disconnection");
+  take_connection();
+  {
+    char host[64];
+    peer_host(session_fd, host, sizeof(host));
+    acct_login(username, pw.pw_uid, host);
+  }
 
-  /* We guard every fork() below with setreuid so the user's resource limits
-   * are correctly applied. */
-  if (setreuid(pw.pw_uid, -1) < 0) perror("setreuid(pw_uid)");
-  while(1) {
-    while(1) {
-      rv = waitpid(-1, 0, WNOHANG);
-      if (rv == 0 || (rv < 0 && errno == ECHILD)) break;
-      if (rv < 0) {
-        perror("waitpid()");
-        (void)write_finish(session_fd, 1);
-        session_fatal(0);
-      }
-    }
-    if (write_text(session_fd, "Command: ") < 0)
-      session_fatal("Unexpected disconnection");
-    if (write_prompt(session_fd, 1) < 0)
-      session_fatal("Unexpected disconnection");
-    char* command = read_reply(session_fd);
-    if (!command) { session_fatal("Unexpected disconnection"); assert(0); }
-    if (!command[0]) break;
-    /* XXX do strvis(command) */
-    debug("Running command \"%s\"", command);
-    fflush(0);
-    int err = fork();
-    if (err < 0) {
-      perror("fork()");
-      (void)write_finish(session_fd, 1);
-      session_fatal(0);
-    }
-    if (err) { free(command); continue; }
-
-    (void)close(session_fd);
-    closefrom(3);
-    signal(SIGPIPE, SIG_DFL);
-
-    if (setreuid(0, -1) < 0) perror("setreuid(root)");
-    if (setuid(pw.pw_uid) < 0 || getuid() != pw.pw_uid || geteuid() != pw.pw_uid)
-      fatal("Could not setuid");
-
-    session_environ();
-    /* We don't perform here pam_end(PAM_DATA_SILENT). On Linux, this tells
-     * the modules only to clean up things local to this process (ie, not
-     * things stored in files. We can't guarantee all modules obey this on
-     * different platforms though, and we're about to `exec`, so it's entirely
-     * fine to leak the process-local things. */
+  for (i = 0; i < MAX_CHANNELS; ++i) channels[i].in_fd = -1;
 
-    execlp(command, command, (char*)0);
-    perror("execlp()");
-    _exit(1);
+  rv = serve_commands();
+  while (resume_grace && !rv) {
+    int fd = offer_resume();
+    if (fd < 0) break;
+    session_fd = fd;
+    /* A new client, which will announce its own frame limit. */
+    frame_max.send = FRAME_MIN;
+    setproctitle("%s [session]", username);
+    logkv(LOG_INFO, "event=resume user=%s", username);
+    if (write_finish(session_fd, 0) < 0 ||
+        write_reply(session_fd, username) < 0)
+      session_fatal("Unexpected disconnection");
+    take_connection();
+    rv = serve_commands();
   }
-  if (setreuid(0, -1) < 0) perror("setreuid(root)");
 
-  (void)write_finish(session_fd, 0);
+  if (session_fd >= 0) (void)write_finish(session_fd, rv);
+  logkv(LOG_INFO, "event=logout user=%s", username);
 
   while(1) {
     rv = wait(0);
@@ -25,6 +25,13 @@
 extern pid_t session_pid;
 extern int session_fd;
 extern int perform_authentication;
+extern int peer_authentication;
+extern int resume_grace;
+extern int max_jobs;
+extern int login_msg;
+extern char* login_reply;
+extern uid_t session_peer_uid;
+extern int session_peer_known;
 void session_cleanup();
 int session_main();
 
@@ -18,6 +18,7 @@
  */
 
 #include "util.h"
+#include "log.h"
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -42,9 +43,8 @@ void debug(const char* str, ...)
   if (!debug_) return;
   va_list ap;
   va_start(ap, str);
-  vfprintf(stderr, str, ap);
+  vlogmsg(LOG_DEBUG, str, ap);
   va_end(ap);
-  fputc('\n', stderr);
 }
 
 void fatal(const char* str, ...)
@@ -56,14 +56,13 @@ void fatal(const char* str, ...)
 
 void vfatal(const char* str, va_list ap)
 {
-  vfprintf(stderr, str, ap);
-  fputc('\n', stderr);
+  vlogmsg(LOG_ERR, str, ap);
   exit(1);
 }
 
 void perror_fatal(const char* str)
 {
-  perror(str);
+  log_perror(str);
   exit(1);
 }
 
@@ -151,7 +150,7 @@ void closefrom(int lowfd)
   /* HP-UX */
   struct pst_status ps;
   if (pstat_getproc(&ps, sizeof(ps), (size_t)0, (int)getpid()) < 0)
-    perror("pstat_getproc()");
+    log_perror("pstat_getproc()");
   int i = lowfd;
   for (; i <= ps.pst_highestfd; ++i) (void)close(i);
 #else
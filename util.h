@@ -25,11 +25,18 @@
 #include <stdarg.h>
 #include <pwd.h>
 
+/* So that the compiler knows the fatal functions don't return. */
+#ifdef __GNUC__
+#define NORETURN __attribute__((noreturn))
+#else
+#define NORETURN
+#endif
+
 extern int debug_;
 void debug(const char* str, ...);
-void fatal(const char* str, ...);
-void vfatal(const char* str, va_list ap);
-void perror_fatal(const char* str);
+NORETURN void fatal(const char* str, ...);
+NORETURN void vfatal(const char* str, va_list ap);
+NORETURN void perror_fatal(const char* str);
 
 void setpasswd(struct passwd* pwp);
 
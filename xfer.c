@@ -0,0 +1,353 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifdef __linux
+#define _GNU_SOURCE /* for splice */
+#endif
+#define _FILE_OFFSET_BITS 64
+
+#include <config.h>
+#include "xfer.h"
+#include "util.h"
+#include "log.h"
+#include "net.h"
+#include "compress.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#if HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/* How often a transfer reports how far it has got. */
+#define XFER_PROGRESS (8*1024*1024)
+
+int xfer_open_local(const char* path, int flags, long long* size)
+{
+  struct stat st;
+  int fd = open(path, flags|O_NOCTTY, 0666);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0) { (void)close(fd); return -1; }
+  if (size) *size = st.st_size;
+  return fd;
+}
+
+/* Write len bytes of the file into the socket. If the file comes up short,
+ * the frame header has already promised the bytes, so we make them up. */
+static int send_payload(int sock, int fd, long long off, int len)
+{
+  static const char zeros[4096];
+  int status = 0;
+#if HAVE_SYS_SENDFILE_H
+  off_t pos = off;
+  while (len && !net_tapped(sock)) {
+    ssize_t n = sendfile(sock, fd, &pos, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno != EINVAL && errno != ENOSYS) return -1;
+    if (n <= 0) break; /* short file, or no sendfile for this fd */
+    len -= n;
+  }
+  off = pos;
+#endif
+  while (len) {
+    char buf[4096];
+    ssize_t n = pread(fd, buf, len < (int)sizeof(buf) ? len : sizeof(buf),
+                      off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    if (write_raw(sock, buf, n) < 0) return -1;
+    off += n;
+    len -= n;
+  }
+  while (len) {
+    int n = len < (int)sizeof(zeros) ? len : sizeof(zeros);
+    status = 1;
+    if (write_raw(sock, zeros, n) < 0) return -1;
+    len -= n;
+  }
+  return status;
+}
+
+/* With compression, the contents have to pass through deflate, so they're
+ * read into a buffer like any other output. */
+static int send_packed(int sock, int channel, int fd, long long off, int len)
+{
+  static char* buf = 0;
+  static int buf_len = 0;
+  int got = 0;
+  if (buf_len < len) {
+    free(buf);
+    if (!(buf = malloc(len))) fatal("malloc()");
+    buf_len = len;
+  }
+  while (got < len) {
+    ssize_t n = pread(fd, buf + got, len - got, off + got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += n;
+  }
+  memset(buf + got, 0, len - got);
+  if (write_bulk(sock, channel, -1, MSG_DATA, buf, len) < 0) return -1;
+  return got < len;
+}
+
+/* One MSG_DATA frame of [off, off+len) of the file. */
+static int send_chunk(int sock, int channel, int fd, long long off, int len)
+{
+  if (compress_active(sock)) return send_packed(sock, channel, fd, off, len);
+  if (write_channel(sock, channel) < 0 || write_uint(sock, MSG_DATA) < 0 ||
+      write_uint(sock, len) < 0)
+    return -1;
+  return send_payload(sock, fd, off, len);
+}
+
+int xfer_send(int sock, int channel, int fd, long long off, long long end,
+              xfer_progress_fn progress)
+{
+  long long next = off + XFER_PROGRESS;
+  int status = 0, chunk = bulk_chunk(sock);
+  while (off < end) {
+    int len = end - off < chunk ? (int)(end - off) : chunk;
+    int rv = send_chunk(sock, channel, fd, off, len);
+    if (rv < 0) return -1;
+    if (rv) status = 1;
+    off += len;
+    if (progress && off >= next && off < end) {
+      if (progress(sock, channel, off, end) < 0) return -1;
+      next = off + XFER_PROGRESS;
+    }
+  }
+  if (write_channel(sock, channel) < 0 || write_uint(sock, MSG_DATA) < 0 ||
+      write_uint(sock, 0) < 0)
+    return -1;
+  return status;
+}
+
+/* Read and throw away the rest of a frame we couldn't store. */
+static int discard_payload(int sock, int len)
+{
+  char buf[4096];
+  while (len) {
+    ssize_t n = read(sock, buf, len < (int)sizeof(buf) ? len : sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    net_tap(sock, 0, buf, n);
+    len -= n;
+  }
+  return 0;
+}
+
+int xfer_recv(int sock, int fd, long long off, int len)
+{
+#if HAVE_SPLICE
+  /* splice() needs a pipe between the socket and the file. */
+  static int pipe_fd[2] = { -1, -1 };
+  if (pipe_fd[0] < 0 && pipe(pipe_fd) < 0) log_perror("pipe()");
+  while (len && pipe_fd[0] >= 0 && !net_tapped(sock)) {
+    ssize_t n = splice(sock, 0, pipe_fd[1], 0, len, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    len -= n;
+    while (n) {
+      loff_t pos = off;
+      ssize_t m = splice(pipe_fd[0], 0, fd, &pos, n, SPLICE_F_MOVE);
+      if (m < 0 && errno == EINTR) continue;
+      if (m <= 0) {
+        /* The file won't take it. Empty the pipe by replacing it. */
+        (void)close(pipe_fd[0]);
+        (void)close(pipe_fd[1]);
+        pipe_fd[0] = pipe_fd[1] = -1;
+        return discard_payload(sock, len) < 0 ? -1 : 1;
+      }
+      off += m;
+      n -= m;
+    }
+  }
+#endif
+  while (len) {
+    char buf[4096];
+    ssize_t n = read(sock, buf, len < (int)sizeof(buf) ? len : sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    net_tap(sock, 0, buf, n);
+    len -= n;
+    char* p = buf;
+    while (n) {
+      ssize_t m = pwrite(fd, p, n, off);
+      if (m < 0 && errno == EINTR) continue;
+      if (m <= 0) return discard_payload(sock, len) < 0 ? -1 : 1;
+      p += m;
+      off += m;
+      n -= m;
+    }
+  }
+  return 0;
+}
+
+int xfer_store(int fd, long long off, const char* buf, int len)
+{
+  while (len) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 1;
+    buf += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* The command loop runs as the user, in the user's home directory, so the
+ * file is opened with the user's permissions alone. */
+static int open_as_user(const char* path, int flags, long long* size)
+{
+  int fd = xfer_open_local(path, flags, size);
+  if (fd >= 0) (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+static int send_progress(int sock, int channel, long long done,
+                         long long size)
+{
+  if (write_channel(sock, channel) < 0) return -1;
+  return write_progress(sock, done, size);
+}
+
+static int xfer_error(int sock, int channel, const char* path)
+{
+  char buf[512];
+  snprintf(buf, sizeof(buf), "%s: %s\n", path, strerror(errno));
+  if (write_channel(sock, channel) < 0 || write_text(sock, buf) < 0)
+    return -1;
+  return 1;
+}
+
+int xfer_begin(struct xfer* x, int sock, int channel, int msg,
+               const char* user, unsigned long long offset,
+               unsigned long long size, char* path)
+{
+  long long have;
+  int rv;
+  x->path = path;
+  x->user = user;
+  x->status = x->saved_errno = 0;
+  x->fd = open_as_user(path, msg == MSG_GET ? O_RDONLY : O_WRONLY|O_CREAT,
+                       &have);
+  if (x->fd < 0) goto fail;
+  if (msg == MSG_PUT && offset == XFER_RESUME) offset = have;
+  if (offset > (unsigned long long)have) {
+    errno = EINVAL;
+    goto fail;
+  }
+  if (msg == MSG_PUT && ftruncate(x->fd, offset) < 0) goto fail;
+  x->start = x->off = x->reported = offset;
+  x->end = msg == MSG_GET ? have : (long long)size;
+  if (send_progress(sock, channel, offset, x->end) < 0) {
+    rv = -1;
+    goto done;
+  }
+  x->msg = msg;
+  return 0;
+
+ fail:
+  rv = xfer_error(sock, channel, path);
+ done:
+  if (x->fd >= 0) (void)close(x->fd);
+  x->fd = -1;
+  free(path);
+  x->path = 0;
+  return rv;
+}
+
+int xfer_get_more(struct xfer* x, int sock, int channel, int* credit)
+{
+  int len = bulk_chunk(sock), rv;
+  if (len > *credit) len = *credit;
+  if (len > x->end - x->off) len = (int)(x->end - x->off);
+  if (len > 0) {
+    if ((rv = send_chunk(sock, channel, x->fd, x->off, len)) < 0) return -1;
+    if (rv && !x->status) {
+      x->status = 1;
+      x->saved_errno = EIO;
+    }
+    x->off += len;
+    *credit -= len;
+    if (x->off >= x->reported + XFER_PROGRESS && x->off < x->end) {
+      if (send_progress(sock, channel, x->off, x->end) < 0) return -1;
+      x->reported = x->off;
+    }
+  }
+  if (x->off < x->end) return 0;
+  if (write_channel(sock, channel) < 0 || write_uint(sock, MSG_DATA) < 0 ||
+      write_uint(sock, 0) < 0)
+    return -1;
+  return 1;
+}
+
+int xfer_put_data(struct xfer* x, int sock, int zframe)
+{
+  int len, msg, rv;
+  if (zframe) {
+    char* buf = read_zframe(sock, &msg, &len);
+    if (!buf || msg != MSG_DATA) {
+      free(buf);
+      return -1;
+    }
+    rv = xfer_store(x->fd, x->off, buf, len);
+    free(buf);
+  } else {
+    if ((len = read_uint(sock)) < 0 || len > frame_max.recv) return -1;
+    if (!len) return 1;
+    rv = xfer_recv(sock, x->fd, x->off, len);
+  }
+  if (rv < 0) return -1;
+  if (rv && !x->status) {
+    x->status = 1;
+    x->saved_errno = errno ? errno : EIO;
+  }
+  x->off += len;
+  return 0;
+}
+
+int xfer_finish(struct xfer* x, int sock, int channel)
+{
+  int rv;
+  (void)close(x->fd);
+  x->fd = -1;
+  logkv(LOG_INFO, "event=%s user=%s bytes=%lld",
+        x->msg == MSG_GET ? "get" : "put", x->user, x->off - x->start);
+  x->msg = 0;
+  if (x->status) {
+    errno = x->saved_errno;
+    rv = xfer_error(sock, channel, x->path);
+  } else {
+    rv = send_progress(sock, channel, x->off, x->end) < 0 ? -1 : 0;
+  }
+  free(x->path);
+  x->path = 0;
+  return rv;
+}
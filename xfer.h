@@ -0,0 +1,91 @@
+/*
+  Copyright (c) 2013 Nicholas Wilson
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#ifndef XFER_H__
+#define XFER_H__
+
+/*
+ * File transfer. The client sends MSG_GET or MSG_PUT on a prompted channel;
+ * the session's command loop, which runs as the user, opens the file, so no
+ * path is ever opened with root's permissions. The contents then move between
+ * the file and the socket with sendfile() and splice() where the platform has
+ * them, and never pass through a user-space buffer, unless the connection is
+ * compressed (see compress.h).
+ *
+ *   Get:  <- MSG_PROGRESS start size, MSG_DATA..., MSG_DATA "", MSG_PROGRESS
+ *   Put:  <- MSG_PROGRESS start size, -> MSG_DATA..., MSG_DATA "",
+ *         <- MSG_PROGRESS
+ *
+ * A get reports progress along the way. A put doesn't, since the client
+ * isn't reading while it sends; the client knows how far it has got.
+ *
+ * The session serves a transfer a frame at a time from its command loop,
+ * alongside the other channels' commands, and sends a get's MSG_DATA only
+ * against the window the client has granted for the channel (see net.h),
+ * as it does a command's output.
+ *
+ * Every message is tagged with the channel, and the server ends with a
+ * MSG_FINISH on it, non-zero if the transfer failed. Transfers resume: a get
+ * starts at the offset asked for, and a put at XFER_RESUME starts wherever
+ * the existing file ends.
+ */
+#define XFER_RESUME ((unsigned long long)-1)
+
+/* Shared by both ends. xfer_send() sends [off, end) of fd as MSG_DATA frames
+ * and the closing empty frame, calling progress (if given) every so often;
+ * xfer_recv() moves one frame's payload from the socket into fd at off. Both
+ * return -1 if the connection is broken, and 1 if only the file failed. */
+typedef int (*xfer_progress_fn)(int sock, int channel, long long done,
+                                long long size);
+int xfer_open_local(const char* path, int flags, long long* size);
+int xfer_send(int sock, int channel, int fd, long long off, long long end,
+              xfer_progress_fn progress);
+int xfer_recv(int sock, int fd, long long off, int len);
+
+/* Write a payload that arrived compressed, and so is already in memory.
+ * Returns 1 if the file failed. */
+int xfer_store(int fd, long long off, const char* buf, int len);
+
+/* The session's side: a transfer in progress on a channel. The functions
+ * below each return -1 if the connection is broken. */
+struct xfer {
+  int msg;          /* MSG_GET or MSG_PUT while under way, else 0 */
+  int fd, status, saved_errno;
+  long long start, off, end, reported;
+  const char* user;
+  char* path;
+};
+
+/* The message's fields have been read: open the file, taking path over, and
+ * report where the transfer starts. Returns 0 once it's under way, or the
+ * status for the channel's MSG_FINISH if it failed already. */
+int xfer_begin(struct xfer* x, int sock, int channel, int msg,
+               const char* user, unsigned long long offset,
+               unsigned long long size, char* path);
+/* Send the next frame of a get, within *credit, which it's charged to.
+ * Returns 1 once the closing empty frame has gone. */
+int xfer_get_more(struct xfer* x, int sock, int channel, int* credit);
+/* Having read a put's MSG_DATA or MSG_ZFRAME, store its payload. Returns 1
+ * for the closing empty frame. */
+int xfer_put_data(struct xfer* x, int sock, int zframe);
+/* Close the file and send the last report. Returns the status for the
+ * channel's MSG_FINISH. */
+int xfer_finish(struct xfer* x, int sock, int channel);
+
+#endif